@@ -3,20 +3,58 @@
 
 #define PAGE_SIZE 4096
 
+// Sv39 superpage sizes
+#define MEGAPAGE_SIZE (1 << 21)
+#define GIGAPAGE_SIZE (1 << 30)
+
 // Kernel stack size 16k
 #define STACK_SIZE 16384
 
-// Kernel heap size 1M
+// Stack traps run on, one per hart.
+#define TRAP_STACK_SIZE 8192
+
+// Kernel heap size 1M, to start with
 #define HEAP_SIZE 1 << 20
+// Fully free heap segments are only handed back while the heap is bigger than this
+#define HEAP_HIGH_WATER (8 << 20)
+
+// Pages mapped per page fault in regions that don't set their own window.
+// Must be a power of two no larger than 512.
+#define FAULT_AROUND_PAGES 16
+
+// Virtual range for large kernel allocations, at the bottom of the Sv39 upper
+// half. Physical memory itself is identity mapped.
+#define VMALLOC_START 0xFFFFFFC000000000
+#define VMALLOC_END 0xFFFFFFD000000000
+
+// Physical address p is also mapped at DIRECT_MAP_START + p in every page
+// table, so the kernel can reach any page without the identity map. Must be
+// gigapage aligned.
+#define DIRECT_MAP_START 0xFFFFFFE000000000
+#define DIRECT_MAP_END 0xFFFFFFF000000000
+
+// Task stacks get a slot of MAX_STACK_SIZE each in this range, the bottom page
+// of which is left unmapped as a guard. Pages are only backed as the stack
+// grows into them. MAX_STACK_SIZE must be a power of two no larger than 2M.
+#define STACKS_START 0xFFFFFFD000000000
+#define STACKS_END 0xFFFFFFE000000000
+#define MAX_STACK_SIZE (1 << 20)
+// Zeroed pages each hart keeps for stack faults, which can't go to the page
+// allocator. The reserve is only refilled between tasks and while idle, so
+// this, not MAX_STACK_SIZE, is how far a single task can grow its stack: 64K
+// past what earlier tasks on the hart already touched. Running out is fatal.
+#define STACK_RESERVE_PAGES 16
 
-// Physical memory map
-#define KERNEL_START 0x80020000
-#define KERNEL_END 0x80030000
-#define FREE_MEMORY_START 0x80030000
-#define FREE_MEMORY_END 0x88000000
+// Physical memory to assume if the device tree doesn't describe any. The
+// kernel image and free memory are otherwise discovered at boot.
+#define DEFAULT_MEMORY_START 0x80000000
+#define DEFAULT_MEMORY_END 0x88000000
 
 // SMP
 #define SMP_ENABLED
-#define NUM_HART 4
+// Upper bound on hart ids. The harts actually present come from the device tree.
+#define MAX_HART 16
+// Upper bound on NUMA node ids, taken from numa-node-id in the device tree.
+#define MAX_NUMA_NODES 8
 
 #endif
@@ -0,0 +1,137 @@
+#include "cpu/trap.h"
+
+#include "config.h"
+#include "io/stdio.h"
+#include "memory/page.h"
+#include "memory/stack.h"
+#include "memory/vmalloc.h"
+#include "thread/hart.h"
+
+#define CSR_STVEC 0x105
+
+namespace cpu {
+
+namespace {
+
+// Traps can't run on the stack they came from, which may be the one that
+// just overflowed. These live in the kernel image, so they're always mapped.
+uint8_t trap_stacks[MAX_HART][TRAP_STACK_SIZE] __attribute__((aligned (16)));
+
+extern "C" void* trap_entry;
+
+// sscratch holds the hart's HartState. Saves the caller-saved registers on
+// the hart's trap stack, calls handle_trap(scause, stval, sepc) and returns
+// to the trapping instruction. Nothing on the way may trap again, since a
+// nested trap would start over at the top of the same trap stack.
+asm volatile(
+	".align 2			\n"
+	"trap_entry:			\n"
+	"csrrw t0, sscratch, t0		\n" // Swap in HartState
+	"sd t1, 16(t0)			\n"
+	"sd sp, 24(t0)			\n"
+	"ld sp, 8(t0)			\n" // Switch to the trap stack
+	"addi sp, sp, -144		\n"
+	"sd ra, 0(sp)			\n"
+	"ld t1, 16(t0)			\n"
+	"sd t1, 16(sp)			\n"
+	"ld t1, 24(t0)			\n"
+	"sd t1, 128(sp)			\n"
+	"csrrw t1, sscratch, t0		\n" // Put HartState back
+	"sd t1, 8(sp)			\n"
+	"sd t2, 24(sp)			\n"
+	"sd t3, 32(sp)			\n"
+	"sd t4, 40(sp)			\n"
+	"sd t5, 48(sp)			\n"
+	"sd t6, 56(sp)			\n"
+	"sd a0, 64(sp)			\n"
+	"sd a1, 72(sp)			\n"
+	"sd a2, 80(sp)			\n"
+	"sd a3, 88(sp)			\n"
+	"sd a4, 96(sp)			\n"
+	"sd a5, 104(sp)			\n"
+	"sd a6, 112(sp)			\n"
+	"sd a7, 120(sp)			\n"
+	"csrr a0, scause		\n"
+	"csrr a1, stval			\n"
+	"csrr a2, sepc			\n"
+	"call handle_trap		\n"
+	"ld ra, 0(sp)			\n"
+	"ld t0, 8(sp)			\n"
+	"ld t1, 16(sp)			\n"
+	"ld t2, 24(sp)			\n"
+	"ld t3, 32(sp)			\n"
+	"ld t4, 40(sp)			\n"
+	"ld t5, 48(sp)			\n"
+	"ld t6, 56(sp)			\n"
+	"ld a0, 64(sp)			\n"
+	"ld a1, 72(sp)			\n"
+	"ld a2, 80(sp)			\n"
+	"ld a3, 88(sp)			\n"
+	"ld a4, 96(sp)			\n"
+	"ld a5, 104(sp)			\n"
+	"ld a6, 112(sp)			\n"
+	"ld a7, 120(sp)			\n"
+	"ld sp, 128(sp)			\n"
+	"sret				\n");
+
+void halt() {
+	thread::stop_hart();
+	while(1) {}
+}
+
+} // namespace
+
+void initialize_traps() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	hart_state->trap_stack_top = (uint64_t)&trap_stacks[hart_state->hart_id][TRAP_STACK_SIZE];
+	asm volatile(
+		"csrw %1, %0		\n"
+		:
+		: "r"(&trap_entry),
+		  "i"(CSR_STVEC)
+		:);
+}
+
+} // namespace cpu
+
+// Only kernel page faults are handled for now. Anything else is fatal.
+extern "C" void handle_trap(uint64_t cause, uint64_t value, uint64_t pc) {
+	uint16_t flags;
+	switch (cause) {
+		case CAUSE_INSTRUCTION_PAGE_FAULT:
+			flags = PAGE_X;
+			break;
+		case CAUSE_LOAD_PAGE_FAULT:
+			flags = PAGE_R;
+			break;
+		case CAUSE_STORE_PAGE_FAULT:
+			flags = PAGE_W;
+			break;
+		default:
+			io::printk("Unhandled trap %x at %x!\n", cause, pc);
+			io::print_stack_trace();
+			cpu::halt();
+	}
+
+	// Stack faults are resolved without any locks the faulting code might be
+	// holding, and never fall back on the general fault path, which may
+	// allocate.
+	if (value >= STACKS_START && value < STACKS_END) {
+		if (!memory::handle_stack_fault(value)) {
+			return;
+		}
+		if (memory::is_stack_guard(value)) {
+			io::printk("Stack overflow at %x!\n", pc);
+		} else {
+			io::printk("Fatal stack fault on %x at %x!\n", value, pc);
+		}
+		io::print_stack_trace();
+		cpu::halt();
+	}
+
+	memory::PageTable* kernel_page_table = memory::get_kernel_page_table();
+	if (!kernel_page_table || kernel_page_table->handle_page_fault(value, flags)) {
+		io::printk("Fatal page fault on %x at %x!\n", value, pc);
+		cpu::halt();
+	}
+}
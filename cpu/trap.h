@@ -0,0 +1,19 @@
+#ifndef CPU_TRAP_H
+#define CPU_TRAP_H
+
+#include <stdint.h>
+
+// scause values, with the interrupt bit clear.
+#define CAUSE_INSTRUCTION_PAGE_FAULT 12
+#define CAUSE_LOAD_PAGE_FAULT 13
+#define CAUSE_STORE_PAGE_FAULT 15
+
+namespace cpu {
+
+// Points the calling hart's trap vector at the kernel's handler and gives it
+// a trap stack. Must be called after thread::init_hart_state.
+void initialize_traps();
+
+} // namespace cpu
+
+#endif
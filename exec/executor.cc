@@ -1,10 +1,13 @@
 #include "exec/executor.h"
-#include "cpu/scratch.h"
+#include "cpu/trap.h"
 #include "thread/hart.h"
 #include "io/stdio.h"
 #include "lib/memory.h"
 #include "memory/heap.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
+#include "memory/stack.h"
+#include "memory/vmalloc.h"
 
 namespace std {
 
@@ -18,32 +21,37 @@ void __throw_bad_function_call() {
 
 namespace exec {
 
+namespace {
+
+// Context of the task each hart is running, if any.
+ExecContext* running_contexts[MAX_HART] = {nullptr};
+
+} // namespace
+
 Executor::Executor() {
-	hart_stacks = (uint8_t**)memory::kmalloc(NUM_HART*sizeof(uint8_t*));
-	for (int hart_id = 0; hart_id < NUM_HART; hart_id++) {
-		memory::PageBlock block;
-		if (memory::allocate_page_block(STACK_SIZE, block)) {
+	for (uint64_t i = 0; i < thread::get_num_harts(); i++) {
+		uint64_t hart_id = thread::get_hart_id(i);
+		// Pages past the top one are backed by the hart itself as the stack
+		// grows, so they land on its own node.
+		void* stack_top = memory::allocate_stack();
+		if (!stack_top) {
 			io::printk("Error allocating HART stacks!\n");
 			io::print_stack_trace();
 		}
-		hart_stacks[hart_id] = (uint8_t*)block.start;
-	}
 
-	for (int hart_id = 0; hart_id < NUM_HART; hart_id++) {
 		default_contexts[hart_id].hart_id = hart_id;
-		default_contexts[hart_id].kernel_stack_top = &(hart_stacks[hart_id][STACK_SIZE]);
+		default_contexts[hart_id].kernel_stack_top = stack_top;
 		default_contexts[hart_id].executor = this;
 	}
 }
 
 Executor::~Executor() {
-	for (int hart_id = 0; hart_id < NUM_HART; hart_id++) {
-		memory::PageBlock block;
-		block.start = (uint64_t)hart_stacks[hart_id];
-		block.size = STACK_SIZE;
-		memory::free_page_block(block);
+	for (uint64_t i = 0; i < thread::get_num_harts(); i++) {
+		void* stack_top = default_contexts[thread::get_hart_id(i)].kernel_stack_top;
+		if (stack_top) {
+			memory::free_stack(stack_top);
+		}
 	}
-	memory::kfree(hart_stacks);
 }
 
 void Executor::exec(std::function<void()> to_run) {
@@ -56,9 +64,21 @@ void Executor::work(int hart_id) {
 	while(is_running) {
 		std::function<void()> task;
 		if (work_queue.dequeue(task)) {
+			ExecContext* context = &default_contexts[hart_id];
+			running_contexts[hart_id] = context;
 			task();
+			running_contexts[hart_id] = nullptr;
+			context->task_arena.reset();
+			memory::refill_stack_reserve();
 		} else if (is_draining) {
 			is_running = false;
+		} else {
+			// Nothing to run, so get ahead on zeroing pages for the fault path,
+			// take back slab objects other harts freed and defragment memory.
+			memory::refill_zero_pool();
+			memory::refill_stack_reserve();
+			memory::drain_slab_remote_frees();
+			memory::compact_memory();
 		}
 	}
 }
@@ -73,21 +93,37 @@ void Executor::drain() {
 
 void Executor::start_threadpool() {
 	int curr_hart_id = 0;
-	for (int hart_id = 0; hart_id < NUM_HART; hart_id++) {
+	for (uint64_t i = 0; i < thread::get_num_harts(); i++) {
+		uint64_t hart_id = thread::get_hart_id(i);
 		if (thread::start_hart(worker_entry, 
 				       hart_id, 
 				       (uint64_t)&(default_contexts[hart_id]), 
-				       &(hart_stacks[hart_id][STACK_SIZE]))) {
+				       default_contexts[hart_id].kernel_stack_top)) {
 			curr_hart_id = hart_id;
 		}
 	}
-	worker_entry(curr_hart_id, (uint64_t)&(default_contexts[curr_hart_id]));
+	// Leave the boot stack, it's small and has no guard page.
+	thread::run_on_stack(worker_entry,
+			     curr_hart_id,
+			     (uint64_t)&(default_contexts[curr_hart_id]),
+			     default_contexts[curr_hart_id].kernel_stack_top);
+}
+
+memory::Arena* get_task_arena() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (!hart_state || !running_contexts[hart_state->hart_id]) {
+		return nullptr;
+	}
+	return &running_contexts[hart_state->hart_id]->task_arena;
 }
 
 void worker_entry(uint64_t hart_id, uint64_t exec_context_ptr) {
 	ExecContext* context = (ExecContext*)exec_context_ptr;
 	Executor* executor = context->executor;
-	cpu::set_scratch(0);
+	thread::init_hart_state(hart_id);
+	cpu::initialize_traps();
+	memory::use_kernel_page_table();
+	memory::refill_stack_reserve();
 	executor->work(hart_id);
 	thread::stop_hart();
 }
@@ -5,6 +5,7 @@
 
 #include "lib/queue.h"
 #include "config.h"
+#include "memory/arena.h"
 
 namespace exec {
 
@@ -14,6 +15,9 @@ struct ExecContext {
 	void* kernel_stack_top;
 	int hart_id;
 	Executor* executor;
+	// Scratch space for whatever task the hart is running, reset as soon as
+	// the task returns.
+	memory::Arena task_arena;
 	//TODO: Page table here
 };
 
@@ -31,10 +35,13 @@ class Executor {
 	bool is_draining = false;
 	bool is_running = true;
 	lib::Queue<std::function<void()>> work_queue;
-	ExecContext default_contexts[NUM_HART];
-	uint8_t** hart_stacks;
+	ExecContext default_contexts[MAX_HART];
 };
 
+// Arena of the task running on the current hart, nullptr outside of a task.
+// Anything allocated from it is gone once the task returns.
+memory::Arena* get_task_arena();
+
 void worker_entry(uint64_t hart_id, uint64_t exec_context_ptr);
 
 } // namespace exec
@@ -0,0 +1,379 @@
+#include <stddef.h>
+
+#include "lib/fdt.h"
+
+namespace lib {
+
+namespace {
+
+#define FDT_MAGIC 0xD00DFEED
+#define FDT_LAST_COMPATIBLE_VERSION 16
+
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE 0x2
+#define FDT_PROP 0x3
+#define FDT_NOP 0x4
+#define FDT_END 0x9
+
+// Defaults the spec mandates when a node doesn't declare its own.
+#define DEFAULT_ADDRESS_CELLS 2
+#define DEFAULT_SIZE_CELLS 1
+
+struct FdtHeader {
+	uint32_t magic;
+	uint32_t totalsize;
+	uint32_t off_dt_struct;
+	uint32_t off_dt_strings;
+	uint32_t off_mem_rsvmap;
+	uint32_t version;
+	uint32_t last_comp_version;
+	uint32_t boot_cpuid_phys;
+	uint32_t size_dt_strings;
+	uint32_t size_dt_struct;
+};
+
+uint32_t read_be32(const uint8_t* data) {
+	return ((uint32_t)data[0] << 24) |
+	       ((uint32_t)data[1] << 16) |
+	       ((uint32_t)data[2] << 8) |
+	       (uint32_t)data[3];
+}
+
+uint64_t read_be64(const uint8_t* data) {
+	return ((uint64_t)read_be32(data) << 32) | read_be32(data + 4);
+}
+
+uint32_t align4(uint32_t value) {
+	return (value + 3) & ~3;
+}
+
+uint32_t string_length(const char* str) {
+	uint32_t len = 0;
+	while (str[len]) {
+		len++;
+	}
+	return len;
+}
+
+bool string_equals(const char* a, const char* b) {
+	while (*a && *a == *b) {
+		a++;
+		b++;
+	}
+	return *a == *b;
+}
+
+// Matches a node name against the first len characters of name, ignoring the
+// node's unit address if name doesn't specify one.
+bool name_matches(const char* node_name, const char* name, uint32_t len) {
+	for (uint32_t i = 0; i < len; i++) {
+		if (node_name[i] != name[i]) {
+			return false;
+		}
+	}
+	return !node_name[len] || node_name[len] == '@';
+}
+
+} // namespace
+
+uint32_t FdtProperty::get_cell(uint32_t index) const {
+	return read_be32(data + index * 4);
+}
+
+uint64_t FdtProperty::get_cells(uint32_t index, uint32_t num_cells) const {
+	uint64_t ret = 0;
+	for (uint32_t i = 0; i < num_cells; i++) {
+		ret = (ret << 32) | get_cell(index + i);
+	}
+	return ret;
+}
+
+uint32_t FdtProperty::num_cells() const {
+	return size / 4;
+}
+
+bool FdtProperty::equals(const char* str) const {
+	return size && string_equals((const char*)data, str);
+}
+
+int Fdt::init(const void* blob) {
+	const uint8_t* header_ptr = (const uint8_t*)blob;
+	this->blob = nullptr;
+	if (!header_ptr || read_be32(header_ptr + offsetof(FdtHeader, magic)) != FDT_MAGIC) {
+		return -1;
+	}
+	if (read_be32(header_ptr + offsetof(FdtHeader, last_comp_version)) > FDT_LAST_COMPATIBLE_VERSION + 1) {
+		return -1;
+	}
+
+	structs = header_ptr + read_be32(header_ptr + offsetof(FdtHeader, off_dt_struct));
+	strings = (const char*)header_ptr + read_be32(header_ptr + offsetof(FdtHeader, off_dt_strings));
+	structs_size = read_be32(header_ptr + offsetof(FdtHeader, size_dt_struct));
+	this->blob = header_ptr;
+
+	return 0;
+}
+
+bool Fdt::is_valid() const {
+	return blob != nullptr;
+}
+
+uint64_t Fdt::get_start() const {
+	return (uint64_t)blob;
+}
+
+uint64_t Fdt::get_size() const {
+	if (!blob) {
+		return 0;
+	}
+	return read_be32(blob + offsetof(FdtHeader, totalsize));
+}
+
+bool Fdt::get_memory_reservation(int index, uint64_t& address, uint64_t& size) const {
+	if (!blob) {
+		return false;
+	}
+
+	const uint8_t* entry = blob + read_be32(blob + offsetof(FdtHeader, off_mem_rsvmap));
+	for (int i = 0; ; i++) {
+		address = read_be64(entry);
+		size = read_be64(entry + 8);
+		if (!address && !size) {
+			return false;
+		}
+		if (i == index) {
+			return true;
+		}
+		entry += 16;
+	}
+}
+
+uint32_t Fdt::read_token(uint32_t offset) const {
+	if (offset + 4 > structs_size) {
+		return FDT_END;
+	}
+	return read_be32(structs + offset);
+}
+
+// Skips any properties and NOPs starting at offset.
+uint32_t Fdt::skip_properties(uint32_t offset) const {
+	while (true) {
+		uint32_t token = read_token(offset);
+		if (token == FDT_PROP) {
+			offset += 12 + align4(read_be32(structs + offset + 4));
+		} else if (token == FDT_NOP) {
+			offset += 4;
+		} else {
+			return offset;
+		}
+	}
+}
+
+// Returns the offset right after the FDT_END_NODE matching the node at offset.
+uint32_t Fdt::skip_node(uint32_t offset) const {
+	int depth = 0;
+	do {
+		switch (read_token(offset)) {
+			case FDT_BEGIN_NODE:
+				depth++;
+				offset += 4 + align4(string_length((const char*)structs + offset + 4) + 1);
+				break;
+			case FDT_END_NODE:
+				depth--;
+				offset += 4;
+				break;
+			case FDT_PROP:
+				offset += 12 + align4(read_be32(structs + offset + 4));
+				break;
+			case FDT_NOP:
+				offset += 4;
+				break;
+			default:
+				return structs_size;
+		}
+	} while (depth > 0);
+
+	return offset;
+}
+
+void Fdt::get_child_cells(const FdtNode& node, uint32_t& address_cells, uint32_t& size_cells) const {
+	FdtProperty property;
+	address_cells = DEFAULT_ADDRESS_CELLS;
+	size_cells = DEFAULT_SIZE_CELLS;
+	if (get_property(node, "#address-cells", property)) {
+		address_cells = property.get_cell(0);
+	}
+	if (get_property(node, "#size-cells", property)) {
+		size_cells = property.get_cell(0);
+	}
+}
+
+bool Fdt::get_root(FdtNode& node) const {
+	if (!blob) {
+		return false;
+	}
+
+	uint32_t offset = skip_properties(0);
+	if (read_token(offset) != FDT_BEGIN_NODE) {
+		return false;
+	}
+	node.offset = offset;
+	node.address_cells = DEFAULT_ADDRESS_CELLS;
+	node.size_cells = DEFAULT_SIZE_CELLS;
+
+	return true;
+}
+
+const char* Fdt::get_name(const FdtNode& node) const {
+	return (const char*)structs + node.offset + 4;
+}
+
+bool Fdt::get_first_child(const FdtNode& node, FdtNode& child) const {
+	uint32_t offset = node.offset + 4 + align4(string_length(get_name(node)) + 1);
+	offset = skip_properties(offset);
+	if (read_token(offset) != FDT_BEGIN_NODE) {
+		return false;
+	}
+
+	// Read the cells before writing child, which may alias node.
+	get_child_cells(node, child.address_cells, child.size_cells);
+	child.offset = offset;
+
+	return true;
+}
+
+bool Fdt::get_next_sibling(const FdtNode& node, FdtNode& sibling) const {
+	uint32_t offset = skip_node(node.offset);
+	while (read_token(offset) == FDT_NOP) {
+		offset += 4;
+	}
+	if (read_token(offset) != FDT_BEGIN_NODE) {
+		return false;
+	}
+
+	sibling.offset = offset;
+	sibling.address_cells = node.address_cells;
+	sibling.size_cells = node.size_cells;
+
+	return true;
+}
+
+bool Fdt::find_child(const FdtNode& node, const char* name, FdtNode& child) const {
+	uint32_t len = string_length(name);
+	bool found = get_first_child(node, child);
+	while (found) {
+		if (name_matches(get_name(child), name, len)) {
+			return true;
+		}
+		found = get_next_sibling(child, child);
+	}
+	return false;
+}
+
+bool Fdt::find_node(const char* path, FdtNode& node) const {
+	if (!get_root(node)) {
+		return false;
+	}
+
+	while (*path) {
+		if (*path == '/') {
+			path++;
+			continue;
+		}
+
+		uint32_t len = 0;
+		while (path[len] && path[len] != '/') {
+			len++;
+		}
+
+		FdtNode child;
+		bool found = get_first_child(node, child);
+		while (found && !name_matches(get_name(child), path, len)) {
+			found = get_next_sibling(child, child);
+		}
+		if (!found) {
+			return false;
+		}
+
+		node = child;
+		path += len;
+	}
+
+	return true;
+}
+
+bool Fdt::get_property(const FdtNode& node, const char* name, FdtProperty& property) const {
+	uint32_t offset = node.offset + 4 + align4(string_length(get_name(node)) + 1);
+	while (true) {
+		uint32_t token = read_token(offset);
+		if (token == FDT_NOP) {
+			offset += 4;
+			continue;
+		} else if (token != FDT_PROP) {
+			return false;
+		}
+
+		uint32_t size = read_be32(structs + offset + 4);
+		const char* prop_name = strings + read_be32(structs + offset + 8);
+		if (string_equals(prop_name, name)) {
+			property.name = prop_name;
+			property.data = structs + offset + 12;
+			property.size = size;
+			return true;
+		}
+		offset += 12 + align4(size);
+	}
+}
+
+bool Fdt::get_reg(const FdtNode& node, int index, uint64_t& address, uint64_t& size) const {
+	FdtProperty reg;
+	if (!get_property(node, "reg", reg)) {
+		return false;
+	}
+
+	uint32_t stride = node.address_cells + node.size_cells;
+	if (!stride || (index + 1) * stride > reg.num_cells()) {
+		return false;
+	}
+	address = reg.get_cells(index * stride, node.address_cells);
+	size = reg.get_cells(index * stride + node.address_cells, node.size_cells);
+
+	return true;
+}
+
+bool Fdt::get_interrupt(const FdtNode& node, int index, uint32_t& interrupt) const {
+	FdtProperty interrupts;
+	if (!get_property(node, "interrupts", interrupts) || (uint32_t)index >= interrupts.num_cells()) {
+		return false;
+	}
+	interrupt = interrupts.get_cell(index);
+	return true;
+}
+
+bool Fdt::is_enabled(const FdtNode& node) const {
+	FdtProperty status;
+	if (!get_property(node, "status", status)) {
+		return true;
+	}
+	return status.equals("okay") || status.equals("ok");
+}
+
+uint64_t Fdt::get_timebase_frequency() const {
+	FdtNode cpus;
+	FdtProperty frequency;
+	if (!find_node("/cpus", cpus)) {
+		return 0;
+	}
+
+	if (!get_property(cpus, "timebase-frequency", frequency)) {
+		// Some trees put it on the individual cpu nodes instead.
+		FdtNode cpu;
+		if (!find_child(cpus, "cpu", cpu) || !get_property(cpu, "timebase-frequency", frequency)) {
+			return 0;
+		}
+	}
+
+	return frequency.get_cells(0, frequency.num_cells());
+}
+
+} // namespace lib
@@ -0,0 +1,78 @@
+#ifndef LIB_FDT_H
+#define LIB_FDT_H
+
+#include <stdint.h>
+
+namespace lib {
+
+// A property value pointing straight into the device tree blob. Cells are
+// stored big endian.
+struct FdtProperty {
+	const char* name;
+	const uint8_t* data;
+	uint32_t size;
+
+	uint32_t get_cell(uint32_t index) const;
+	// Reads a value spanning num_cells cells, starting at cell index.
+	uint64_t get_cells(uint32_t index, uint32_t num_cells) const;
+	uint32_t num_cells() const;
+	// True if the property is a string equal to str.
+	bool equals(const char* str) const;
+};
+
+// A node is just the offset of its FDT_BEGIN_NODE token, plus the
+// #address-cells and #size-cells its parent declares for its reg property.
+struct FdtNode {
+	uint32_t offset;
+	uint32_t address_cells;
+	uint32_t size_cells;
+};
+
+// Zero-copy reader for a flattened device tree. Nothing is parsed up front,
+// every lookup walks the blob in place.
+class Fdt {
+	public:
+	// Returns -1 if blob doesn't point at a valid device tree.
+	int init(const void* blob);
+
+	bool is_valid() const;
+	uint64_t get_start() const;
+	uint64_t get_size() const;
+
+	// Entries in the memory reservation block.
+	bool get_memory_reservation(int index, uint64_t& address, uint64_t& size) const;
+
+	bool get_root(FdtNode& node) const;
+	const char* get_name(const FdtNode& node) const;
+	bool get_first_child(const FdtNode& node, FdtNode& child) const;
+	bool get_next_sibling(const FdtNode& node, FdtNode& sibling) const;
+	// Path components match node names with or without their unit address,
+	// e.g. "/cpus/cpu" finds "/cpus/cpu@0".
+	bool find_node(const char* path, FdtNode& node) const;
+	bool find_child(const FdtNode& node, const char* name, FdtNode& child) const;
+
+	bool get_property(const FdtNode& node, const char* name, FdtProperty& property) const;
+	// Decodes the index'th (address, size) pair of the node's reg property.
+	bool get_reg(const FdtNode& node, int index, uint64_t& address, uint64_t& size) const;
+	// Returns the index'th cell of the node's interrupts property.
+	bool get_interrupt(const FdtNode& node, int index, uint32_t& interrupt) const;
+	// False for nodes whose status is anything other than "okay".
+	bool is_enabled(const FdtNode& node) const;
+
+	uint64_t get_timebase_frequency() const;
+
+	private:
+	const uint8_t* blob = nullptr;
+	const uint8_t* structs;
+	const char* strings;
+	uint32_t structs_size;
+
+	uint32_t read_token(uint32_t offset) const;
+	uint32_t skip_properties(uint32_t offset) const;
+	uint32_t skip_node(uint32_t offset) const;
+	void get_child_cells(const FdtNode& node, uint32_t& address_cells, uint32_t& size_cells) const;
+};
+
+} // namespace lib
+
+#endif
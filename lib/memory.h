@@ -1,6 +1,7 @@
 #ifndef LIB_MEMORY_H
 #define LIB_MEMORY_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace lib {
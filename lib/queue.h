@@ -1,6 +1,8 @@
 #ifndef LIB_QUEUE_H
 #define LIB_QUEUE_H
 
+#include <new>
+
 #include "io/stdio.h"
 #include "memory/heap.h"
 #include "thread/lock.h"
@@ -13,10 +15,12 @@ struct QueueNode {
 	QueueNode<T>* next;
 };
 
-template <class T>
+// Nodes come from Allocator, which needs allocate(size) and
+// deallocate(ptr). See memory::HeapAllocator and memory::ArenaAllocator.
+template <class T, class Allocator = memory::HeapAllocator>
 class Queue {
 	public:
-	Queue();
+	Queue(Allocator allocator = Allocator());
 	Queue(Queue& to_copy);
 	Queue(Queue&& to_move);
 	~Queue();
@@ -28,20 +32,24 @@ class Queue {
 	private:
 	QueueNode<T>* head;
 	QueueNode<T>* tail;
+	Allocator allocator;
+
+	QueueNode<T>* new_node(T& data);
+	void delete_node(QueueNode<T>* node);
 
 	thread::Lock queue_mutex;
 };
 
-template <class T>
-Queue<T>::Queue() {
+template <class T, class Allocator>
+Queue<T, Allocator>::Queue(Allocator allocator) : allocator(allocator) {
 	queue_mutex.lock();
 	head = nullptr;
 	tail = nullptr;
 	queue_mutex.unlock();
 }
 
-template <class T>
-Queue<T>::Queue(Queue& to_copy) {
+template <class T, class Allocator>
+Queue<T, Allocator>::Queue(Queue& to_copy) : allocator(to_copy.allocator) {
 	to_copy.queue_mutex.lock();
 	queue_mutex.lock();
 
@@ -63,8 +71,8 @@ Queue<T>::Queue(Queue& to_copy) {
 	queue_mutex.unlock();
 }
 
-template <class T>
-Queue<T>::Queue(Queue&& to_move) {
+template <class T, class Allocator>
+Queue<T, Allocator>::Queue(Queue&& to_move) : allocator(to_move.allocator) {
 	to_move.queue_mutex.lock();
 	queue_mutex.lock();
 
@@ -77,35 +85,31 @@ Queue<T>::Queue(Queue&& to_move) {
 	queue_mutex.unlock();
 }
 
-template <class T>
-Queue<T>::~Queue() {
+template <class T, class Allocator>
+Queue<T, Allocator>::~Queue() {
 	T discard;
 	while(dequeue(discard));
 }
 
-template <class T>
-void Queue<T>::enqueue(T to_enqueue) {
+template <class T, class Allocator>
+void Queue<T, Allocator>::enqueue(T to_enqueue) {
 	queue_mutex.lock();
 
 	if (!tail) {
-		tail = new QueueNode<T>();
-		tail->data = to_enqueue;
-		tail->next = nullptr;
+		tail = new_node(to_enqueue);
 		head = tail;
 		queue_mutex.unlock();
 		return;
 	}
 
-	tail->next = new QueueNode<T>();
-	tail->next->data = to_enqueue;
-	tail->next->next = nullptr;
+	tail->next = new_node(to_enqueue);
 	tail = tail->next;
 
 	queue_mutex.unlock();
 }
 
-template <class T>
-bool Queue<T>::dequeue(T& ret) {
+template <class T, class Allocator>
+bool Queue<T, Allocator>::dequeue(T& ret) {
 	queue_mutex.lock();
 	if (!head) {
 		queue_mutex.unlock();
@@ -114,7 +118,7 @@ bool Queue<T>::dequeue(T& ret) {
 
 	ret = head->data;
 	QueueNode<T>* next = head->next;
-	delete head;
+	delete_node(head);
 	head = next;
 	if (!head) {
 		tail = nullptr;
@@ -124,13 +128,27 @@ bool Queue<T>::dequeue(T& ret) {
 	return true;
 }
 
-template <class T>
-bool Queue<T>::is_empty() {
+template <class T, class Allocator>
+bool Queue<T, Allocator>::is_empty() {
 	queue_mutex.lock();
 	return head == nullptr;
 	queue_mutex.unlock();
 }
 
+template <class T, class Allocator>
+QueueNode<T>* Queue<T, Allocator>::new_node(T& data) {
+	QueueNode<T>* node = new (allocator.allocate(sizeof(QueueNode<T>))) QueueNode<T>();
+	node->data = data;
+	node->next = nullptr;
+	return node;
+}
+
+template <class T, class Allocator>
+void Queue<T, Allocator>::delete_node(QueueNode<T>* node) {
+	node->~QueueNode<T>();
+	allocator.deallocate(node);
+}
+
 } // namespace lib
 
 #endif
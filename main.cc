@@ -1,8 +1,13 @@
+#include "cpu/trap.h"
 #include "exec/executor.h"
 #include "io/stdio.h"
+#include "lib/fdt.h"
 #include "lib/queue.h"
 #include "memory/heap.h"
+#include "memory/heap_profile.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
+#include "memory/vmalloc.h"
 #include "thread/hart.h"
 #include "thread/lock.h"
 
@@ -43,11 +48,25 @@ void bar() {
 	}
 }
 
-extern "C" void kernel_main(void) {
+lib::Fdt boot_fdt;
+
+extern "C" void kernel_main(uint64_t hart_id, uint64_t fdt_addr) {
+	thread::init_hart_state(hart_id);
+	cpu::initialize_traps();
+
 	io::puts("Hello, world!\n");
 	io::printk("Testing, kernel_main loaded at %x\n", kernel_main);
 
+	if (boot_fdt.init((void*)fdt_addr)) {
+		io::printk("No valid device tree at %x!\n", fdt_addr);
+	}
+	thread::initialize_harts(boot_fdt, hart_id);
+	io::printk("%d harts, timebase %d Hz\n", thread::get_num_harts(), boot_fdt.get_timebase_frequency());
+
+	memory::initialize_page_allocator(boot_fdt);
 	memory::initialize_heap(HEAP_SIZE);
+	memory::initialize_vmalloc();
+	memory::start_heap_profile(1);
 
 	void* ptr1 = memory::kmalloc(300);
 	void* ptr2 = memory::kmalloc(300);
@@ -61,6 +80,11 @@ extern "C" void kernel_main(void) {
 
 	int* ptr4 = new int[64];
 	io::printk("Free memory: %d\n", memory::calc_free_memory());
+	memory::print_heap_stats();
+	memory::print_slab_stats();
+	memory::print_page_allocator_stats();
+	memory::stop_heap_profile();
+	memory::print_heap_profile();
 
 	exec::Executor executor;
 	executor.exec(foo);
@@ -0,0 +1,121 @@
+#include "memory/arena.h"
+
+#include "io/stdio.h"
+#include "memory/page_allocator.h"
+
+namespace memory {
+
+namespace {
+
+using io::printk;
+using io::print_stack_trace;
+
+// Keeps the bump area 16 byte aligned.
+#define ARENA_CHUNK_HEADER_SIZE 16
+
+uint64_t align_up(uint64_t value, uint64_t align) {
+	return (value + align - 1) & ~(align - 1);
+}
+
+} // namespace
+
+struct ArenaChunk {
+	ArenaChunk* next;
+	uint64_t size;
+};
+
+Arena::Arena(uint64_t chunk_size) {
+	this->chunk_size = align_up(chunk_size, PAGE_SIZE);
+}
+
+Arena::~Arena() {
+	free_chunks(chunks);
+}
+
+void Arena::free_chunks(ArenaChunk* chunk) {
+	while (chunk) {
+		ArenaChunk* next = chunk->next;
+		PageBlock block;
+		block.start = (uint64_t)chunk;
+		block.size = chunk->size;
+		free_page_block(block);
+		chunk = next;
+	}
+}
+
+void* Arena::alloc(uint64_t size, uint64_t align) {
+	if (!size) {
+		return nullptr;
+	}
+	if (align > PAGE_SIZE || (align & (align - 1))) {
+		printk("Bad arena alignment %d!\n", align);
+		print_stack_trace();
+		return nullptr;
+	}
+
+	uint64_t start = align_up(bump, align);
+	if (bump && start + size <= bump_end) {
+		bump = start + size;
+		bytes_allocated += size;
+		return (void*)start;
+	}
+
+	// Chunks are page aligned, so this much always fits the request.
+	uint64_t needed = ARENA_CHUNK_HEADER_SIZE + align - 1 + size;
+	bool dedicated = needed > chunk_size;
+	PageBlock block;
+	if (allocate_page_block(dedicated ? align_up(needed, PAGE_SIZE) : chunk_size, block)) {
+		printk("Out of memory for arena!\n");
+		print_stack_trace();
+		return nullptr;
+	}
+
+	ArenaChunk* chunk = (ArenaChunk*)block.start;
+	chunk->size = block.size;
+	start = align_up(block.start + ARENA_CHUNK_HEADER_SIZE, align);
+	if (dedicated && chunks) {
+		// Leave the current chunk at the head, it may still have room.
+		chunk->next = chunks->next;
+		chunks->next = chunk;
+	} else {
+		chunk->next = chunks;
+		chunks = chunk;
+		if (dedicated) {
+			bump = 0;
+			bump_end = 0;
+		} else {
+			bump = start + size;
+			bump_end = block.start + block.size;
+		}
+	}
+
+	bytes_allocated += size;
+	return (void*)start;
+}
+
+void Arena::reset() {
+	bytes_allocated = 0;
+	if (!chunks) {
+		return;
+	}
+
+	ArenaChunk* keep = chunks;
+	if (keep->size != chunk_size) {
+		free_chunks(chunks);
+		chunks = nullptr;
+		bump = 0;
+		bump_end = 0;
+		return;
+	}
+
+	free_chunks(keep->next);
+	keep->next = nullptr;
+	bump = (uint64_t)keep + ARENA_CHUNK_HEADER_SIZE;
+	bump_end = (uint64_t)keep + keep->size;
+}
+
+uint64_t Arena::get_bytes_allocated() {
+	return bytes_allocated;
+}
+
+} // namespace memory
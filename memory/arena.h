@@ -0,0 +1,64 @@
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define ARENA_DEFAULT_ALIGN 16
+
+namespace memory {
+
+struct ArenaChunk;
+
+// Bump allocator for short lived objects that all die together. Memory comes
+// from the page allocator in chunk_size chunks and is only given back by
+// reset or the destructor. Not thread safe, an arena belongs to one task.
+class Arena {
+	public:
+	Arena(uint64_t chunk_size=PAGE_SIZE);
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	// align must be a power of two no larger than PAGE_SIZE. Requests too big
+	// for a chunk get a dedicated block of their own.
+	void* alloc(uint64_t size, uint64_t align=ARENA_DEFAULT_ALIGN);
+
+	// Frees everything allocated so far. One chunk is kept back so the next
+	// user doesn't go straight back to the page allocator.
+	void reset();
+
+	uint64_t get_bytes_allocated();
+
+	private:
+	uint64_t chunk_size;
+	// The chunk being bumped is always at the head. Dedicated blocks are
+	// linked in behind it.
+	ArenaChunk* chunks = nullptr;
+	uint64_t bump = 0;
+	uint64_t bump_end = 0;
+	uint64_t bytes_allocated = 0;
+
+	void free_chunks(ArenaChunk* chunk);
+};
+
+// Allocator adaptor for containers such as lib::Queue. Individual frees are
+// no-ops, everything goes when the arena is reset.
+class ArenaAllocator {
+	public:
+	ArenaAllocator(Arena* arena) : arena(arena) {}
+
+	void* allocate(uint64_t size) {
+		return arena->alloc(size);
+	}
+
+	void deallocate(void* to_free) {}
+
+	private:
+	Arena* arena;
+};
+
+} // namespace memory
+
+#endif
@@ -1,7 +1,10 @@
 #include "memory/heap.h"
 
 #include "io/stdio.h"
+#include "memory/heap_profile.h"
 #include "memory/page_allocator.h"
+#include "memory/slab.h"
+#include "memory/vmalloc.h"
 #include "thread/lock.h"
 
 namespace memory {
@@ -11,103 +14,204 @@ namespace {
 using io::printk;
 using io::print_stack_trace;
 
+// Requests this big skip the heap and get their own pages from vmalloc.
+#define LARGE_ALLOC_SIZE (4 * PAGE_SIZE)
+
+// Every chunk starts with a header and ends with a footer holding the same
+// tag, the chunk's total size with CHUNK_FREE in the low bit. That lets kfree
+// find both neighbours and merge with them in constant time.
+#define CHUNK_FREE 0x1
+#define CHUNK_ALIGN 16
+#define CHUNK_OVERHEAD (2 * sizeof(uint64_t))
+// Room for the tags and the free list links.
+#define MIN_CHUNK_SIZE 32
+
+// Each segment the heap grows by is twice the size of the last, up to this.
+#define MAX_SEGMENT_SIZE (16 << 20)
+
+// A segment's header, followed by an allocated tag, its chunks, and another
+// allocated tag. The tags keep merges from running off the segment, and a
+// free chunk between two of them spans the whole segment.
+#define SEGMENT_START (2 * CHUNK_ALIGN)
+#define SEGMENT_OVERHEAD (SEGMENT_START + CHUNK_ALIGN)
+
 thread::Lock heap_mutex;
 
-struct __attribute__((packed)) FreeChunkHeader {
-	FreeChunkHeader* next;
-	FreeChunkHeader* prev;
+// Free chunks keep their free list links right after the header.
+struct FreeChunk {
+	uint64_t header;
+	FreeChunk* next;
+	FreeChunk* prev;
+};
+
+struct HeapSegment {
 	uint64_t size;
 };
 
-FreeChunkHeader* heap_start = nullptr;
+FreeChunk* free_chunks = nullptr;
 
-void* kmalloc_internal(uint64_t size) {
-	heap_mutex.lock();
+// Size of the next segment to add, zero until the heap is initialized.
+uint64_t next_segment_size = 0;
 
-	FreeChunkHeader* curr = heap_start;
-	while(curr && curr->size < size) {
-		curr = curr->next;
-	}
+// Counters kept up to date under heap_mutex. The free chunk figures are
+// filled in when a snapshot is taken.
+HeapStats heap_stats;
 
-	if (!curr) {
-		heap_mutex.unlock();
-		return nullptr;
+int histogram_bucket(uint64_t size) {
+	int bucket = 0;
+	while (bucket < HEAP_HISTOGRAM_BUCKETS - 1 && (HEAP_HISTOGRAM_MIN << (bucket + 1)) <= size) {
+		bucket++;
 	}
+	return bucket;
+}
 
-	if (curr->size - size > sizeof(FreeChunkHeader)) {
-		FreeChunkHeader* new_chunk = curr + sizeof(FreeChunkHeader) + size;
-		new_chunk->size = curr->size - size - sizeof(FreeChunkHeader);
-		new_chunk->prev = curr->prev;
-		new_chunk->next = curr->next;
-		if (new_chunk->next) {
-			new_chunk->next->prev = new_chunk;
-		}
-		if (new_chunk->prev) {
-			new_chunk->prev->next = new_chunk;
-		}
+uint64_t chunk_size(uint64_t* header) {
+	return *header & ~(uint64_t)CHUNK_FREE;
+}
+
+bool chunk_free(uint64_t* header) {
+	return *header & CHUNK_FREE;
+}
+
+uint64_t* chunk_footer(uint64_t* header) {
+	return (uint64_t*)((uint64_t)header + chunk_size(header)) - 1;
+}
+
+void set_chunk(uint64_t* header, uint64_t size, bool free) {
+	*header = size | (free ? CHUNK_FREE : 0);
+	*chunk_footer(header) = *header;
+}
 
-		curr->next = new_chunk;
-		curr->size = size;
+void push_free_chunk(FreeChunk* chunk) {
+	chunk->prev = nullptr;
+	chunk->next = free_chunks;
+	if (chunk->next) {
+		chunk->next->prev = chunk;
 	}
+	free_chunks = chunk;
+}
 
-	if (heap_start == curr) {
-		heap_start = curr->next;
+void remove_free_chunk(FreeChunk* chunk) {
+	if (chunk->prev) {
+		chunk->prev->next = chunk->next;
+	} else {
+		free_chunks = chunk->next;
 	}
+	if (chunk->next) {
+		chunk->next->prev = chunk->prev;
+	}
+}
 
-	heap_mutex.unlock();
+// Adds a segment of at least size bytes, all of it one free chunk. Caller
+// must hold heap_mutex.
+FreeChunk* add_segment(uint64_t size) {
+	PageBlock block;
+	if (allocate_page_block(size, block)) {
+		return nullptr;
+	}
 
-	return (void*)((uint64_t)curr + sizeof(FreeChunkHeader));
+	HeapSegment* segment = (HeapSegment*)block.start;
+	segment->size = block.size;
+
+	uint64_t* start_tag = (uint64_t*)(block.start + SEGMENT_START) - 1;
+	uint64_t* end_tag = (uint64_t*)(block.start + block.size - CHUNK_ALIGN);
+	*start_tag = 0;
+	*end_tag = 0;
+
+	FreeChunk* chunk = (FreeChunk*)(block.start + SEGMENT_START);
+	set_chunk(&chunk->header, block.size - SEGMENT_OVERHEAD, true);
+	push_free_chunk(chunk);
+
+	heap_stats.heap_size += block.size;
+	heap_stats.num_segments++;
+
+	return chunk;
 }
 
-} // namespace
+// Grows the heap by the next geometric step, or by enough for needed if
+// that's bigger. Caller must hold heap_mutex.
+FreeChunk* grow_heap(uint64_t needed) {
+	uint64_t size = next_segment_size;
+	if (size < needed + SEGMENT_OVERHEAD) {
+		size = needed + SEGMENT_OVERHEAD;
+	}
 
+	FreeChunk* chunk = add_segment(size);
+	if (chunk && next_segment_size < MAX_SEGMENT_SIZE) {
+		next_segment_size *= 2;
+	}
+	return chunk;
+}
 
-void defragment_heap() {
-	heap_mutex.lock();
+// Returns the segment if chunk spans all of it.
+HeapSegment* whole_segment(uint64_t* header) {
+	if (*(header - 1) || *(uint64_t*)((uint64_t)header + chunk_size(header))) {
+		return nullptr;
+	}
+	return (HeapSegment*)((uint64_t)header - SEGMENT_START);
+}
 
-	if (!heap_start) {
-		return;
+void* kmalloc_internal(uint64_t size) {
+	uint64_t needed = (size + CHUNK_OVERHEAD + CHUNK_ALIGN - 1) & ~((uint64_t)CHUNK_ALIGN - 1);
+	if (needed < MIN_CHUNK_SIZE) {
+		needed = MIN_CHUNK_SIZE;
 	}
 
-	FreeChunkHeader* curr = heap_start;
-	FreeChunkHeader* streak_start = curr;
-	FreeChunkHeader* streak_end = curr;
+	heap_mutex.lock();
 
-	while(curr) {
-		if (curr + sizeof(FreeChunkHeader) + curr->size == curr->next) {
-			streak_end = curr->next;
-		} else {
-			FreeChunkHeader new_chunk;
-			new_chunk.next = streak_end->next;
-			new_chunk.prev = streak_start->prev;
-			new_chunk.size = (streak_end + streak_end->size + sizeof(FreeChunkHeader)) - (streak_start + sizeof(FreeChunkHeader));
-			streak_start->next = new_chunk.next;
-			streak_start->prev = new_chunk.prev;
-			streak_start->size = new_chunk.size;
-		}
+	FreeChunk* curr = free_chunks;
+	while (curr && chunk_size(&curr->header) < needed) {
 		curr = curr->next;
 	}
 
-	heap_mutex.unlock();
-}
+	if (!curr) {
+		curr = grow_heap(needed);
+	}
+	if (!curr) {
+		heap_mutex.unlock();
+		return nullptr;
+	}
 
-int initialize_heap(uint64_t init_heap_size) {
-	PageBlock heap_block;
-	if (allocate_page_block(init_heap_size + sizeof(FreeChunkHeader), heap_block)) {
-		printk("Cannot allocate heap of size %d.\n", init_heap_size);
-		return -1;
+	remove_free_chunk(curr);
+
+	// Split off the tail if it's big enough to be a chunk of its own.
+	uint64_t size_left = chunk_size(&curr->header) - needed;
+	if (size_left >= MIN_CHUNK_SIZE) {
+		FreeChunk* rest = (FreeChunk*)((uint64_t)curr + needed);
+		set_chunk(&rest->header, size_left, true);
+		push_free_chunk(rest);
+	} else {
+		needed = chunk_size(&curr->header);
 	}
+	set_chunk(&curr->header, needed, false);
 
-	heap_start = (FreeChunkHeader*)heap_block.start;
-	heap_start->next = nullptr;
-	heap_start->prev = nullptr;
-	heap_start->size = heap_block.size - sizeof(FreeChunkHeader);
+	heap_stats.allocations++;
+	heap_stats.used_bytes += needed;
+	if (heap_stats.used_bytes > heap_stats.peak_used_bytes) {
+		heap_stats.peak_used_bytes = heap_stats.used_bytes;
+	}
 
-	return 0;
+	heap_mutex.unlock();
+
+	return (void*)((uint64_t)curr + sizeof(uint64_t));
 }
 
-void* kmalloc(uint64_t size) {
-	if (!heap_start) {
+// kmalloc without the profiling hook.
+void* kmalloc_any(uint64_t size) {
+	if (size >= LARGE_ALLOC_SIZE && get_kernel_page_table()) {
+		return vmalloc(size);
+	}
+
+	// Small requests come out of the size classes, anything the slabs can't
+	// serve falls through to the heap.
+	if (size <= SLAB_MAX_SIZE) {
+		void* ret = slab_alloc(size);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (!next_segment_size) {
 		printk("kmalloc: No heap!\n");
 		print_stack_trace();
 		return nullptr;
@@ -115,10 +219,9 @@ void* kmalloc(uint64_t size) {
 
 	void* ret = kmalloc_internal(size);
 	if (!ret) {
-		defragment_heap();
-		ret = kmalloc_internal(size);
-	}	
-	if (!ret) {
+		heap_mutex.lock();
+		heap_stats.failures++;
+		heap_mutex.unlock();
 		printk("kmalloc: Out of memory!\n");
 		print_stack_trace();
 		return nullptr;
@@ -127,67 +230,143 @@ void* kmalloc(uint64_t size) {
 	return ret;
 }
 
-void kfree(void* to_free) {
+} // namespace
+
+int initialize_heap(uint64_t init_heap_size) {
 	heap_mutex.lock();
+	next_segment_size = init_heap_size;
+	FreeChunk* chunk = grow_heap(0);
+	heap_mutex.unlock();
+
+	if (!chunk) {
+		printk("Cannot allocate heap of size %d.\n", init_heap_size);
+		return -1;
+	}
 
-	FreeChunkHeader* new_free_chunk = (FreeChunkHeader*)((uint64_t)to_free - sizeof(FreeChunkHeader));
+	return 0;
+}
 
-	if (!heap_start) {
-		heap_start = new_free_chunk;
-		heap_start->prev = nullptr;
-		heap_start->next = nullptr;
-		heap_mutex.unlock();
+void* kmalloc(uint64_t size) {
+	return kmalloc_from(size, (uint64_t)__builtin_return_address(0));
+}
+
+void* kmalloc_from(uint64_t size, uint64_t caller) {
+	void* ret = kmalloc_any(size);
+	profile_alloc(ret, size, caller);
+	return ret;
+}
+
+void kfree(void* to_free) {
+	if (!to_free) {
 		return;
 	}
-	
-	if (heap_start > new_free_chunk) {
-		new_free_chunk->prev = nullptr;
-		new_free_chunk->next = heap_start;
-		heap_start->prev = new_free_chunk;
-		heap_start = new_free_chunk;
-		heap_mutex.unlock();
+	// Before the memory can be handed out again and sampled under a new site.
+	profile_free(to_free);
+	if (is_vmalloc_address(to_free)) {
+		vfree(to_free);
+		return;
+	}
+	if (is_slab_address(to_free)) {
+		slab_free(to_free);
 		return;
 	}
 
-	FreeChunkHeader* curr = heap_start;
-	while(curr->next && curr->next < new_free_chunk) {
-		curr = curr->next;
+	heap_mutex.lock();
+
+	uint64_t* header = (uint64_t*)to_free - 1;
+	uint64_t size = chunk_size(header);
+	heap_stats.frees++;
+	heap_stats.used_bytes -= size;
+
+	// Merge with the chunk after us, then with the chunk before us.
+	uint64_t* next = (uint64_t*)((uint64_t)header + size);
+	if (chunk_free(next)) {
+		remove_free_chunk((FreeChunk*)next);
+		size += chunk_size(next);
 	}
-	new_free_chunk->next = curr->next;
-	new_free_chunk->prev = curr->prev;
-	curr->next = new_free_chunk;
-	if (new_free_chunk->next) {
-		new_free_chunk->next->prev = new_free_chunk;
+	uint64_t* prev_footer = header - 1;
+	if (chunk_free(prev_footer)) {
+		header = (uint64_t*)((uint64_t)header - chunk_size(prev_footer));
+		remove_free_chunk((FreeChunk*)header);
+		size += chunk_size(prev_footer);
+	}
+
+	set_chunk(header, size, true);
+
+	// Hand whole segments back once the heap is past its high-water mark.
+	HeapSegment* segment = whole_segment(header);
+	if (segment && heap_stats.heap_size > HEAP_HIGH_WATER) {
+		heap_stats.heap_size -= segment->size;
+		heap_stats.num_segments--;
+		heap_mutex.unlock();
+
+		PageBlock block;
+		block.start = (uint64_t)segment;
+		block.size = segment->size;
+		free_page_block(block);
+		return;
 	}
 
+	push_free_chunk((FreeChunk*)header);
+
 	heap_mutex.unlock();
 }
 
-uint64_t calc_free_memory() {
-	defragment_heap();
-
+void get_heap_stats(HeapStats& stats) {
 	heap_mutex.lock();
 
-	uint64_t ret = 0;
-	FreeChunkHeader* curr = heap_start;
+	stats = heap_stats;
+	FreeChunk* curr = free_chunks;
 	while(curr) {
-		ret += curr->size;
+		uint64_t size = chunk_size(&curr->header);
+		stats.free_bytes += size;
+		stats.free_chunk_count++;
+		if (size > stats.largest_free_chunk) {
+			stats.largest_free_chunk = size;
+		}
+		stats.free_chunks[histogram_bucket(size)]++;
 		curr = curr->next;
 	}
 
 	heap_mutex.unlock();
+}
 
-	return ret;
+void print_heap_stats() {
+	HeapStats stats;
+	get_heap_stats(stats);
+	printk("Heap: %d used, %d free of %d in %d segments, %d peak used, largest free chunk %d\n",
+	       stats.used_bytes,
+	       stats.free_bytes,
+	       stats.heap_size,
+	       stats.num_segments,
+	       stats.peak_used_bytes,
+	       stats.largest_free_chunk);
+	printk("Heap: %d allocations, %d frees, %d failures, %d free chunks\n",
+	       stats.allocations,
+	       stats.frees,
+	       stats.failures,
+	       stats.free_chunk_count);
+	for (int i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++) {
+		if (stats.free_chunks[i]) {
+			printk("  %d free chunks from %d bytes\n", stats.free_chunks[i], (uint64_t)HEAP_HISTOGRAM_MIN << i);
+		}
+	}
+}
+
+uint64_t calc_free_memory() {
+	HeapStats stats;
+	get_heap_stats(stats);
+	return stats.free_bytes;
 }
 
 } // namespace memory
 
 void *operator new(size_t size) {
-	return memory::kmalloc(size);
+	return memory::kmalloc_from(size, (uint64_t)__builtin_return_address(0));
 }
 
 void *operator new[](size_t size) {
-	return memory::kmalloc(size);
+	return memory::kmalloc_from(size, (uint64_t)__builtin_return_address(0));
 }
 
 void operator delete(void* p) {
@@ -4,20 +4,66 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Has to come before the declarations below, which it would otherwise
+// conflict with.
+#include <new>
+
+// Free chunk histogram buckets double in size starting from 16 bytes. The
+// first bucket also takes anything smaller, the last anything bigger.
+#define HEAP_HISTOGRAM_BUCKETS 16
+#define HEAP_HISTOGRAM_MIN 16ULL
+
 namespace memory {
 
-int initialize_heap(uint64_t init_heap_size);
+// Snapshot of the heap. Requests kmalloc hands to the slabs or to vmalloc
+// aren't included.
+struct HeapStats {
+	uint64_t heap_size;
+	uint64_t num_segments;
+	uint64_t used_bytes;
+	uint64_t peak_used_bytes;
+	uint64_t free_bytes;
+	uint64_t largest_free_chunk;
+	uint64_t free_chunk_count;
+	uint64_t free_chunks[HEAP_HISTOGRAM_BUCKETS];
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t failures;
+};
 
-void defragment_heap();
+// Sets up the first segment. The heap grows by segments of twice the size of
+// the last one as it fills up.
+int initialize_heap(uint64_t init_heap_size);
 
 void* kmalloc(uint64_t size);
 
+// kmalloc on behalf of caller, which is the return address the heap profile
+// charges the allocation to. For wrappers such as operator new.
+void* kmalloc_from(uint64_t size, uint64_t caller);
+
 void kfree(void* to_free);
 
+// Walks the free list once under the heap lock. Sizes include the chunk tags.
+void get_heap_stats(HeapStats& stats);
+
+void print_heap_stats();
+
 // This memory isn't guaranteed to be contiguous, so this is a crude health
-// metric at best.
+// metric at best. get_heap_stats has the breakdown.
 uint64_t calc_free_memory();
 
+// Default allocator for containers such as lib::Queue.
+class HeapAllocator {
+	public:
+	void* allocate(uint64_t size) {
+		return kmalloc(size);
+	}
+
+	void deallocate(void* to_free) {
+		kfree(to_free);
+	}
+};
+
 } // namespace memory
 
 void *operator new(size_t size);
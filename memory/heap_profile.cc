@@ -0,0 +1,265 @@
+#include "memory/heap_profile.h"
+
+#include "io/stdio.h"
+#include "thread/lock.h"
+
+namespace memory {
+
+namespace {
+
+using io::printk;
+
+// Buckets in the filter profile_free checks before taking the lock.
+#define SAMPLE_FILTER_SIZE (HEAP_PROFILE_MAX_LIVE * 2)
+
+struct LiveSample {
+	uint64_t ptr;
+	uint64_t size;
+	HeapProfileSite* site;
+};
+
+thread::Lock profile_mutex;
+
+// All kmalloc checks while no profile is running.
+bool profiling = false;
+uint64_t sample_interval = 0;
+
+// Counts down by the size of each allocation, one is sampled when it runs
+// out. Updated without the lock.
+int64_t bytes_until_sample = 0;
+
+// Both tables are open addressed with linear probing.
+HeapProfileSite sites[HEAP_PROFILE_SITES];
+LiveSample live_samples[HEAP_PROFILE_MAX_LIVE];
+uint64_t num_live = 0;
+
+// Live samples per bucket of pointer hashes. Only changed under the lock, but
+// read without it so frees of pointers that were never sampled stay cheap.
+uint16_t sample_filter[SAMPLE_FILTER_SIZE];
+
+uint64_t total_allocations = 0;
+uint64_t dropped_samples = 0;
+
+uint64_t hash(uint64_t value) {
+	value ^= value >> 33;
+	value *= 0xFF51AFD7ED558CCDULL;
+	value ^= value >> 33;
+	return value;
+}
+
+// Caller must hold profile_mutex.
+HeapProfileSite* find_site(uint64_t caller) {
+	uint64_t index = hash(caller) % HEAP_PROFILE_SITES;
+	for (int i = 0; i < HEAP_PROFILE_SITES; i++) {
+		HeapProfileSite* site = &sites[index];
+		if (site->caller == caller) {
+			return site;
+		}
+		if (!site->caller) {
+			site->caller = caller;
+			return site;
+		}
+		index = (index + 1) % HEAP_PROFILE_SITES;
+	}
+	return nullptr;
+}
+
+// Caller must hold profile_mutex.
+LiveSample* find_live_sample(uint64_t ptr) {
+	uint64_t index = hash(ptr) % HEAP_PROFILE_MAX_LIVE;
+	while (live_samples[index].ptr) {
+		if (live_samples[index].ptr == ptr) {
+			return &live_samples[index];
+		}
+		index = (index + 1) % HEAP_PROFILE_MAX_LIVE;
+	}
+	return nullptr;
+}
+
+// Caller must hold profile_mutex and have checked there's room.
+void insert_live_sample(uint64_t ptr, uint64_t size, HeapProfileSite* site) {
+	uint64_t index = hash(ptr) % HEAP_PROFILE_MAX_LIVE;
+	while (live_samples[index].ptr) {
+		index = (index + 1) % HEAP_PROFILE_MAX_LIVE;
+	}
+	live_samples[index].ptr = ptr;
+	live_samples[index].size = size;
+	live_samples[index].site = site;
+	num_live++;
+	__atomic_add_fetch(&sample_filter[hash(ptr) % SAMPLE_FILTER_SIZE], 1, __ATOMIC_RELAXED);
+}
+
+// Shifts later entries of the probe run back into the hole, so lookups never
+// need tombstones. Caller must hold profile_mutex.
+void remove_live_sample(LiveSample* sample) {
+	__atomic_sub_fetch(&sample_filter[hash(sample->ptr) % SAMPLE_FILTER_SIZE], 1, __ATOMIC_RELAXED);
+	uint64_t hole = sample - live_samples;
+	uint64_t index = hole;
+	while (true) {
+		index = (index + 1) % HEAP_PROFILE_MAX_LIVE;
+		if (!live_samples[index].ptr) {
+			break;
+		}
+		uint64_t home = hash(live_samples[index].ptr) % HEAP_PROFILE_MAX_LIVE;
+		// Entries whose home lies cyclically in (hole, index] stay put.
+		bool stays = hole <= index ? (hole < home && home <= index) : (hole < home || home <= index);
+		if (!stays) {
+			live_samples[hole] = live_samples[index];
+			hole = index;
+		}
+	}
+	live_samples[hole].ptr = 0;
+	num_live--;
+}
+
+// Indices of the top num_top sites by key, biggest first. Returns how many
+// were found.
+int top_sites(int* top, int num_top, uint64_t HeapProfileSite::*key) {
+	int found = 0;
+	for (int i = 0; i < HEAP_PROFILE_SITES; i++) {
+		if (!sites[i].caller || !(sites[i].*key)) {
+			continue;
+		}
+		int pos = found < num_top ? found++ : num_top;
+		while (pos > 0 && sites[top[pos - 1]].*key < sites[i].*key) {
+			if (pos < num_top) {
+				top[pos] = top[pos - 1];
+			}
+			pos--;
+		}
+		if (pos < num_top) {
+			top[pos] = i;
+		}
+	}
+	return found;
+}
+
+} // namespace
+
+void start_heap_profile(uint64_t sample_bytes) {
+	profile_mutex.lock();
+	for (int i = 0; i < HEAP_PROFILE_SITES; i++) {
+		sites[i] = {};
+	}
+	for (int i = 0; i < HEAP_PROFILE_MAX_LIVE; i++) {
+		live_samples[i].ptr = 0;
+	}
+	for (int i = 0; i < SAMPLE_FILTER_SIZE; i++) {
+		sample_filter[i] = 0;
+	}
+	num_live = 0;
+	total_allocations = 0;
+	dropped_samples = 0;
+	sample_interval = sample_bytes ? sample_bytes : 1;
+	bytes_until_sample = sample_interval;
+	profiling = true;
+	profile_mutex.unlock();
+}
+
+void stop_heap_profile() {
+	profile_mutex.lock();
+	profiling = false;
+	profile_mutex.unlock();
+}
+
+void profile_alloc(void* ptr, uint64_t size, uint64_t caller) {
+	if (!profiling || !ptr) {
+		return;
+	}
+	__atomic_add_fetch(&total_allocations, 1, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&bytes_until_sample, size, __ATOMIC_RELAXED) > 0) {
+		return;
+	}
+
+	profile_mutex.lock();
+	if (!profiling) {
+		profile_mutex.unlock();
+		return;
+	}
+	bytes_until_sample = sample_interval;
+
+	// A sample stands in for everything allocated since the last one.
+	uint64_t weight = size > sample_interval ? size : sample_interval;
+	uint64_t count = size > sample_interval || !size ? 1 : sample_interval / size;
+	HeapProfileSite* site = find_site(caller);
+	// Keep the live table at most three quarters full so probe runs stay short.
+	if (!site || num_live >= HEAP_PROFILE_MAX_LIVE * 3 / 4) {
+		dropped_samples++;
+		profile_mutex.unlock();
+		return;
+	}
+	site->allocations += count;
+	site->total_bytes += weight;
+	site->live_bytes += weight;
+	insert_live_sample((uint64_t)ptr, weight, site);
+
+	profile_mutex.unlock();
+}
+
+void profile_free(void* ptr) {
+	// A sampled pointer was counted in the filter before kmalloc returned it,
+	// so an empty bucket means there's nothing to look up.
+	if (!profiling ||
+	    !__atomic_load_n(&sample_filter[hash((uint64_t)ptr) % SAMPLE_FILTER_SIZE], __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	profile_mutex.lock();
+	LiveSample* sample = find_live_sample((uint64_t)ptr);
+	if (sample) {
+		sample->site->live_bytes -= sample->size;
+		remove_live_sample(sample);
+	}
+	profile_mutex.unlock();
+}
+
+int get_heap_profile(HeapProfileSite* ret, int max_sites) {
+	int top[HEAP_PROFILE_SITES];
+	if (max_sites > HEAP_PROFILE_SITES) {
+		max_sites = HEAP_PROFILE_SITES;
+	}
+
+	profile_mutex.lock();
+	int found = top_sites(top, max_sites, &HeapProfileSite::live_bytes);
+	for (int i = 0; i < found; i++) {
+		ret[i] = sites[top[i]];
+	}
+	profile_mutex.unlock();
+
+	return found;
+}
+
+void print_heap_profile() {
+	int top[HEAP_PROFILE_TOP_SITES];
+
+	profile_mutex.lock();
+	printk("Heap profile: %d allocations, 1 sample per %d bytes, %d samples dropped\n",
+	       total_allocations,
+	       sample_interval,
+	       dropped_samples);
+
+	int found = top_sites(top, HEAP_PROFILE_TOP_SITES, &HeapProfileSite::live_bytes);
+	printk("Top sites by live bytes:\n");
+	for (int i = 0; i < found; i++) {
+		HeapProfileSite& site = sites[top[i]];
+		printk("  %x: %d live, %d total in %d allocations\n",
+		       site.caller,
+		       site.live_bytes,
+		       site.total_bytes,
+		       site.allocations);
+	}
+
+	found = top_sites(top, HEAP_PROFILE_TOP_SITES, &HeapProfileSite::allocations);
+	printk("Top sites by allocation count, with their share of all allocations:\n");
+	for (int i = 0; i < found; i++) {
+		HeapProfileSite& site = sites[top[i]];
+		printk("  %x: %d allocations (%d%%), %d live\n",
+		       site.caller,
+		       site.allocations,
+		       total_allocations ? site.allocations * 100 / total_allocations : 0,
+		       site.live_bytes);
+	}
+	profile_mutex.unlock();
+}
+
+} // namespace memory
@@ -0,0 +1,49 @@
+#ifndef MEMORY_HEAP_PROFILE_H
+#define MEMORY_HEAP_PROFILE_H
+
+#include <stdint.h>
+
+// Call sites tracked at once. Allocations from sites that don't fit are
+// only counted as dropped.
+#define HEAP_PROFILE_SITES 256
+// Sampled allocations that can be live at once.
+#define HEAP_PROFILE_MAX_LIVE 4096
+// Sites listed by print_heap_profile.
+#define HEAP_PROFILE_TOP_SITES 10
+
+namespace memory {
+
+// Figures are estimates scaled up from the sampled allocations, exact when
+// every allocation is sampled.
+struct HeapProfileSite {
+	uint64_t caller;
+	uint64_t allocations;
+	uint64_t live_bytes;
+	uint64_t total_bytes;
+};
+
+// Starts recording kmalloc and operator new call sites, throwing away any
+// previous profile. An allocation is sampled every sample_bytes bytes, so 1
+// records every allocation.
+void start_heap_profile(uint64_t sample_bytes);
+
+// Stops recording, the profile is kept for print_heap_profile.
+void stop_heap_profile();
+
+// Hooks for kmalloc and kfree. They return straight away unless a profile is
+// running, and profile_free only takes the lock for pointers that may have
+// been sampled.
+void profile_alloc(void* ptr, uint64_t size, uint64_t caller);
+void profile_free(void* ptr);
+
+// Returns the number of sites copied into sites, busiest by live bytes first.
+int get_heap_profile(HeapProfileSite* sites, int max_sites);
+
+// Top sites by live bytes, then by allocation count. There's no clock to turn
+// counts into rates, so each site's count is also shown as a share of every
+// allocation made while profiling.
+void print_heap_profile();
+
+} // namespace memory
+
+#endif
@@ -4,33 +4,337 @@
 #include "lib/memory.h"
 #include "memory/page_allocator.h"
 #include "memory/heap.h"
+#include "memory/vmalloc.h"
+#include "thread/hart.h"
+#include "thread/lock.h"
+#include "thread/rcu.h"
 
 namespace memory {
 
 namespace {
 
-#define PAGING_39_BIT (8 << 60)
-
 #define CSR_SATP 0x180
 
-using lib::bzero;
+// Sv39, Sv48 and Sv57 only differ in how many levels a walk goes through. Their
+// SATP modes are 8, 9 and 10.
+#define MIN_PAGING_LEVELS 3
+#define MAX_PAGING_LEVELS 5
+#define SATP_MODE_SHIFT 60
+#define SATP_MODE(levels) ((uint64_t)(levels) + 5)
+
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFULL
+#define SATP_PPN_MASK 0xFFFFFFFFFFFULL
+
+// Unmapping more leaves than this flushes the whole ASID instead of each
+// leaf's address.
+#define TLB_FLUSH_LEAF_LIMIT 32
+
+#define PTE_PPN_SHIFT 10
+#define PTE_PPN_MASK 0xFFFFFFFFFFFULL
+#define PTE_LEAF (PAGE_R | PAGE_W | PAGE_X)
+
+// Size of the region mapped by a single entry at the given level.
+#define LEVEL_SIZE(level) ((uint64_t)PAGE_SIZE << (9 * (level)))
+#define VPN(virtual_addr, level) (((virtual_addr) >> (12 + 9 * (level))) & 0x1FF)
+
+uint64_t make_pte(uint64_t physical_addr, uint16_t flags) {
+	return ((physical_addr / PAGE_SIZE) << PTE_PPN_SHIFT) | flags | PAGE_V;
+}
+
+uint64_t pte_to_physical(uint64_t pte) {
+	return ((pte >> PTE_PPN_SHIFT) & PTE_PPN_MASK) * PAGE_SIZE;
+}
+
+// Page table pages are reached through the direct map, whichever table is
+// loaded.
+uint64_t* table_at(uint64_t physical_addr) {
+	return (uint64_t*)phys_to_virt(physical_addr);
+}
+
+bool is_leaf(uint64_t pte) {
+	return pte & PTE_LEAF;
+}
+
+void flush_tlb() {
+	asm volatile(
+		"sfence.vma zero, zero	\n"
+		:
+		:
+		: "memory");
+}
+
+// Global entries are left alone.
+void flush_tlb_asid(uint64_t asid) {
+	asm volatile(
+		"sfence.vma zero, %0	\n"
+		:
+		: "r"(asid)
+		: "memory");
+}
+
+void flush_tlb_page(uint64_t virtual_addr, uint64_t asid) {
+	asm volatile(
+		"sfence.vma %0, %1	\n"
+		:
+		: "r"(virtual_addr),
+		  "r"(asid)
+		: "memory");
+}
+
+// Flushes virtual_addr under every ASID, global entries included.
+void flush_tlb_global_page(uint64_t virtual_addr) {
+	asm volatile(
+		"sfence.vma %0, zero	\n"
+		:
+		: "r"(virtual_addr)
+		: "memory");
+}
+
+uint64_t read_satp() {
+	uint64_t ret;
+	asm volatile(
+		"csrr %0, %1		\n"
+		: "=r"(ret)
+		: "i"(CSR_SATP)
+		:);
+	return ret;
+}
+
+void write_satp(uint64_t satp) {
+	asm volatile(
+		"csrw %1, %0		\n"
+		:
+		: "r"(satp),
+		  "i"(CSR_SATP)
+		:);
+}
+
+// Shared read-only page every read fault on a managed region maps until the
+// first write. Allocated on first use and never freed.
+uint64_t zero_page = 0;
+
+// Returns 0 if there's no page to spare for it.
+uint64_t get_zero_page() {
+	uint64_t page = __atomic_load_n(&zero_page, __ATOMIC_ACQUIRE);
+	if (page) {
+		return page;
+	}
+
+	PageBlock block;
+	if (allocate_page_block(PAGE_SIZE, block, PAGE_BLOCK_ZERO | PAGE_BLOCK_TRY)) {
+		return 0;
+	}
+	if (!__atomic_compare_exchange_n(&zero_page, &page, block.start, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free_page_block(block);
+		return page;
+	}
+	return block.start;
+}
+
+bool is_zero_page(uint64_t physical_addr) {
+	return physical_addr && physical_addr == __atomic_load_n(&zero_page, __ATOMIC_ACQUIRE);
+}
+
+// Set once at boot by initialize_paging, before any tables exist.
+int paging_levels = MIN_PAGING_LEVELS;
+
+thread::Lock asid_mutex;
+
+// Zero until the first table is loaded and the hardware is probed. ASID 0 is
+// only used when there are no others.
+uint64_t num_asids = 0;
+uint64_t next_asid = 1;
+// Bumped whenever the ASIDs run out and are all handed out again.
+uint64_t current_generation = 1;
+// Generation each hart last flushed its whole TLB for.
+uint64_t hart_generations[MAX_HART];
+// Table each hart has loaded. Only touched by the hart itself.
+PageTable* hart_tables[MAX_HART];
+
+// The ASID field is WARL, so writing all ones reads back the bits that are
+// implemented.
+uint64_t probe_num_asids(uint64_t satp) {
+	write_satp(satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+	uint64_t max_asid = (read_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+	write_satp(satp);
+	flush_tlb();
+	return max_asid + 1;
+}
+
+// Returns the highest level at which a single leaf can map virtual_addr while
+// staying inside [virtual_start, virtual_end), given that virtual_addr is
+// backed by physical_addr.
+int fit_leaf_level(uint64_t virtual_start, uint64_t virtual_end, uint64_t virtual_addr, uint64_t physical_addr) {
+	for (int level = paging_levels - 1; level > 0; level--) {
+		uint64_t size = LEVEL_SIZE(level);
+		uint64_t window = virtual_addr & ~(size - 1);
+		if (window >= virtual_start &&
+		    window + size <= virtual_end &&
+		    (physical_addr & (size - 1)) == (virtual_addr & (size - 1))) {
+			return level;
+		}
+	}
+	return 0;
+}
+
+uint16_t leaf_flags(uint16_t flags) {
+	// Set A and D up front so hardware without A/D updating doesn't fault on them.
+	uint16_t ret = flags | PAGE_A;
+	if (flags & PAGE_W) {
+		ret |= PAGE_D;
+	}
+	return ret;
+}
 
+void add_to_shootdown(TlbShootdown& shootdown, uint64_t virtual_addr, uint64_t size, uint64_t pte) {
+	if (virtual_addr < shootdown.start) {
+		shootdown.start = virtual_addr;
+	}
+	if (virtual_addr + size > shootdown.end) {
+		shootdown.end = virtual_addr + size;
+	}
+	shootdown.num_leaves++;
+	shootdown.global |= pte & PAGE_G;
 }
 
-MemoryRegion::MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, bool managed_alloc=true) {
+// Single pages may be copy-on-write and still mapped elsewhere.
+void free_leaf_block(PageBlock& block) {
+	if (is_zero_page(block.start)) {
+		return;
+	} else if (block.size == PAGE_SIZE) {
+		release_page(block.start);
+	} else {
+		free_page_block(block);
+	}
+}
+
+// Tries the mode on a throwaway root that identity maps the low half of the
+// address space with top level leaves, so the probe keeps running whether or
+// not the mode sticks. Paging must be off.
+bool probe_paging_mode(int levels) {
+	PageBlock root_block;
+	if (allocate_page_block(PAGE_SIZE, root_block, PAGE_BLOCK_ZERO)) {
+		return false;
+	}
+	uint64_t* root = table_at(root_block.start);
+	for (uint64_t i = 0; i < 256; i++) {
+		root[i] = make_pte(i * LEVEL_SIZE(levels - 1), leaf_flags(PAGE_R | PAGE_W | PAGE_X));
+	}
+
+	// Writes with an unsupported mode are ignored altogether.
+	write_satp((SATP_MODE(levels) << SATP_MODE_SHIFT) | (root_block.start / PAGE_SIZE));
+	bool supported = (read_satp() >> SATP_MODE_SHIFT) == SATP_MODE(levels);
+	write_satp(0);
+	flush_tlb();
+
+	free_page_block(root_block);
+	return supported;
+}
+
+// Walks are unrolled at compile time for each mode, one instance per level,
+// so every VPN shift is a constant. level counts down from the root.
+template <int level>
+uint64_t* find_leaf(uint64_t* table, uint64_t virtual_addr, int& leaf_level) {
+	uint64_t* entry = table + VPN(virtual_addr, level);
+	if (!(*entry & PAGE_V) || is_leaf(*entry)) {
+		leaf_level = level;
+		return (*entry & PAGE_V) ? entry : nullptr;
+	}
+	return find_leaf<level - 1>(table_at(pte_to_physical(*entry)), virtual_addr, leaf_level);
+}
+
+// Only reached through a malformed pointer entry at level 0.
+template <>
+uint64_t* find_leaf<-1>(uint64_t* table, uint64_t virtual_addr, int& leaf_level) {
+	leaf_level = 0;
+	return nullptr;
+}
+
+template <int level>
+bool install_leaf_at(uint64_t* table, uint64_t virtual_addr, uint64_t pte, int leaf_level) {
+	uint64_t* entry = table + VPN(virtual_addr, level);
+	if (level == leaf_level) {
+		uint64_t empty = 0;
+		return __atomic_compare_exchange_n(entry, &empty, pte, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+
+	uint64_t curr = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+	if (!(curr & PAGE_V)) {
+		PageBlock new_table;
+		if (allocate_page_block(PAGE_SIZE, new_table, PAGE_BLOCK_ZERO)) {
+			return false;
+		}
+		uint64_t table_pte = make_pte(new_table.start, 0);
+		if (__atomic_compare_exchange_n(entry, &curr, table_pte, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			curr = table_pte;
+		} else {
+			free_page_block(new_table);
+		}
+	}
+	if (is_leaf(curr)) {
+		return false;
+	}
+	return install_leaf_at<level - 1>(table_at(pte_to_physical(curr)), virtual_addr, pte, leaf_level);
+}
+
+template <>
+bool install_leaf_at<-1>(uint64_t* table, uint64_t virtual_addr, uint64_t pte, int leaf_level) {
+	return false;
+}
+
+bool is_red(MemoryRegion* node) {
+	return node && node->red;
+}
+
+void update_max_end(MemoryRegion* node) {
+	node->max_end = node->virtual_end;
+	if (node->left && node->left->max_end > node->max_end) {
+		node->max_end = node->left->max_end;
+	}
+	if (node->right && node->right->max_end > node->max_end) {
+		node->max_end = node->right->max_end;
+	}
+}
+
+// Fixes max_end from node up to the root after a region below changed.
+void update_max_end_path(MemoryRegion* node) {
+	while (node) {
+		update_max_end(node);
+		node = node->parent;
+	}
+}
+
+} // namespace
+
+MemoryRegion::MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, uint16_t flags, bool managed_alloc) {
 	this->virtual_start = virtual_start;
 	this->virtual_end = virtual_end;
+	this->flags = flags;
 	this->managed_alloc = managed_alloc;
-	this->physical_start = nullptr;
-	this->physical_end = nullptr;
+	this->physical_start = 0;
+	this->physical_end = 0;
 	this->left = nullptr;
 	this->right = nullptr;
 	this->parent = nullptr;
+	this->red = true;
+	this->max_end = virtual_end;
+	this->fault_around_pages = FAULT_AROUND_PAGES;
+	this->copy_on_write = false;
+	this->pinned = false;
 }
 
-MemoryRegion::MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint64_t physical_end) {
+MemoryRegion::MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint64_t physical_end, uint16_t flags, bool managed_alloc) {
+	this->left = nullptr;
+	this->right = nullptr;
+	this->parent = nullptr;
+	this->red = true;
+	this->max_end = virtual_end;
+	this->fault_around_pages = FAULT_AROUND_PAGES;
+	this->copy_on_write = false;
+	this->pinned = false;
 	if (virtual_end - virtual_start != physical_end - physical_start) {
-		io::printk("Memory region %x-%x does not match size of physical region %x-%x", 
+		io::printk("Memory region %x-%x does not match size of physical region %x-%x",
 			   virtual_start,
 			   virtual_end,
 			   physical_start,
@@ -42,268 +346,1233 @@ MemoryRegion::MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, uint64_
 	this->virtual_end = virtual_end;
 	this->physical_start = physical_start;
 	this->physical_end = physical_end;
+	this->flags = flags;
 	this->managed_alloc = managed_alloc;
-	this->left = nullptr;
-	this->right = nullptr;
-	this->parent = nullptr;
 }
 
-MemoryRegion::~MemoryRegion() {
-	if (managed_alloc) {
-		PageBlock to_free;
-		to_free.start = physical_start;
-		to_free.size = physical_end - physical_start;
-		free_page_block(to_free);
+MemoryRegion* MemoryRegion::split(uint64_t virtual_addr) {
+	MemoryRegion* upper = new MemoryRegion(virtual_addr, virtual_end, flags, managed_alloc);
+	upper->fault_around_pages = fault_around_pages;
+	upper->copy_on_write = copy_on_write;
+	upper->pinned = pinned;
+	if (!managed_alloc) {
+		upper->physical_start = physical_start + (virtual_addr - virtual_start);
+		upper->physical_end = physical_end;
+		physical_end = upper->physical_start;
 	}
+	virtual_end = virtual_addr;
+	return upper;
 }
 
-void MemoryRegion::allocate_pages() {
-	if (!managed_alloc) {
-		io::printk("Cannot allocate pages of unmanaged memory region!\n");
+PageTable::PageTable() {
+	root_memory_region = nullptr;
+	root_page_table = 0;
+
+	PageBlock root_block;
+	if (allocate_page_block(PAGE_SIZE, root_block, PAGE_BLOCK_ZERO)) {
+		io::printk("Error allocating root page table!\n");
 		io::print_stack_trace();
 		return;
 	}
+	root_page_table = root_block.start;
 
-	PageBlock new_physical_page_block;
-	size_t target_size = virtual_end - virtual_start;
-	if (allocate_page_block(target_size, new_physical_page_block)) {
-		io::printk("Cannot allocate page block for memory region %x-%x", virtual_start, virtual_end);
-		io::print_stack_trace();
-		return;
+	// Copies the kernel's direct map leaves, which never change after boot.
+	// Under Sv39 they're all in the root. Deeper modes need a table or two of
+	// our own above them.
+	PageTable* kernel_page_table = get_kernel_page_table();
+	uint64_t virtual_addr = DIRECT_MAP_START;
+	while (kernel_page_table && virtual_addr < DIRECT_MAP_END) {
+		int level;
+		uint64_t* kernel_entry = kernel_page_table->get_page_table_entry(virtual_addr, level);
+		if (kernel_entry) {
+			uint64_t* entry = get_or_create_page_table_entry(virtual_addr, level);
+			if (!entry) {
+				return;
+			}
+			*entry = *kernel_entry;
+		}
+		virtual_addr = (virtual_addr & ~(LEVEL_SIZE(level) - 1)) + LEVEL_SIZE(level);
 	}
-	physical_start = new_physical_page_block.start;
-	physical_end = physical_start + new_physical_page_block.size;
 }
 
-int PageTable::map_pages(uint64_t virtual_start, uint64_t virtual_end, uint16_t flags) {
+PageTable::~PageTable() {
+	// Held throughout so compaction can't migrate a page out from under us.
 	page_table_mutex.lock();
+	free_memory_regions(root_memory_region);
+	flush_pending();
+	if (root_page_table) {
+		free_page_table(root_page_table, paging_levels - 1);
+	}
+	// Freeing our pages cleared their owners, but compaction may have read
+	// one just before. It only ever try_locks us, so waiting for it with the
+	// lock held can't deadlock.
+	thread::synchronize_rcu();
+	page_table_mutex.unlock();
+}
+
+int PageTable::map_pages(uint64_t virtual_start, uint64_t virtual_end, uint16_t flags) {
+	begin_update();
 
+	if (clear_memory_regions(virtual_start, virtual_end)) {
+		end_update();
+		return -1;
+	}
 	MemoryRegion* to_insert = new MemoryRegion(virtual_start, virtual_end, flags);
 	insert_memory_region(to_insert);
 
-	page_table_mutex.unlock();
+	end_update();
+
+	return 0;
 }
 
 int PageTable::map_pages(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint64_t physical_end, uint16_t flags) {
-	page_table_mutex.lock();
+	if (virtual_end - virtual_start != physical_end - physical_start) {
+		io::printk("map_pages: Virtual range %x-%x does not match physical range %x-%x!\n",
+			   virtual_start,
+			   virtual_end,
+			   physical_start,
+			   physical_end);
+		return -1;
+	}
 
+	begin_update();
+
+	if (clear_memory_regions(virtual_start, virtual_end)) {
+		end_update();
+		return -1;
+	}
 	MemoryRegion* to_insert = new MemoryRegion(virtual_start, virtual_end, physical_start, physical_end, flags);
 	insert_memory_region(to_insert);
+	map_range(virtual_start, virtual_end, physical_start, flags);
 
-	page_table_mutex.unlock();
+	end_update();
+
+	return 0;
 }
 
 int PageTable::unmap_pages(uint64_t virtual_start, uint64_t virtual_end) {
+	begin_update();
+
+	int ret = clear_memory_regions(virtual_start, virtual_end);
+
+	end_update();
+
+	return ret;
+}
+
+int PageTable::populate_pages(uint64_t virtual_start, uint64_t virtual_end) {
 	page_table_mutex.lock();
 
-	MemoryRegion* to_delete = new MemoryRegion(virtual_start, virtual_end, 0);
-	insert_memory_region(to_delete);
-	remove_memory_region(to_delete);
+	uint64_t virtual_addr = virtual_start;
+	while (virtual_addr < virtual_end) {
+		int level;
+		uint64_t* entry = get_page_table_entry(virtual_addr, level);
+		if (!entry) {
+			MemoryRegion* region = find_memory_region(virtual_addr);
+			if (!region || map_fault(region, virtual_addr, region->flags, level) ||
+			    !get_page_table_entry(virtual_addr, level)) {
+				page_table_mutex.unlock();
+				return -1;
+			}
+		}
+		virtual_addr = (virtual_addr & ~(LEVEL_SIZE(level) - 1)) + LEVEL_SIZE(level);
+	}
 
 	page_table_mutex.unlock();
+
+	return 0;
 }
 
-void PageTable::handle_page_fault(uint64_t virtual_addr, uint16_t flags) {
-	disable_paging();
+// Runs under translation. Page tables are walked through the direct map, so
+// the TLB survives apart from the faulting address.
+int PageTable::handle_page_fault(uint64_t virtual_addr, uint16_t flags) {
+	// Faults only read the region tree and install entries with
+	// compare-and-swap, so they run side by side. They just have to stay out
+	// of the way of structural changes, and queue up on the lock behind one
+	// that's under way.
+	thread::rcu_read_lock();
+	bool locked = __atomic_load_n(&updating, __ATOMIC_ACQUIRE);
+	if (locked) {
+		thread::rcu_read_unlock();
+		page_table_mutex.lock();
+	}
 
-	page_table_mutex.lock();
+	int ret = resolve_fault(virtual_addr, flags);
+
+	if (locked) {
+		page_table_mutex.unlock();
+	} else {
+		thread::rcu_read_unlock();
+	}
+
+	if (ret) {
+		io::printk("Unexpected page fault!\n");
+		io::print_stack_trace();
+	}
+
+	return ret;
+}
+
+int PageTable::install_page(uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags) {
+	uint64_t page_addr = virtual_addr & ~(PAGE_SIZE - 1);
+	int ret = 0;
+	if (install_leaf(page_addr, make_pte(physical_addr, leaf_flags(flags)), 0)) {
+		__atomic_add_fetch(&fault_stats.faults, 1, __ATOMIC_RELAXED);
+	} else {
+		ret = get_page_table_entry(page_addr) ? 1 : -1;
+	}
+
+	uint64_t* entry = get_page_table_entry(page_addr);
+	if (entry) {
+		flush_leaf(page_addr, *entry);
+	}
+	return ret;
+}
 
+// Caller must either hold page_table_mutex or be in a read-side critical
+// section with no update under way.
+int PageTable::resolve_fault(uint64_t virtual_addr, uint16_t flags) {
 	MemoryRegion* region = find_memory_region(virtual_addr);
-	if (region) {
-		if (region->flags & flags == flags) {
-			if (!get_page_table_entry(virtual_addr)) {
-				if (region->managed_alloc && !region->physical_start) {
-					if (!region->physical_start) {
-						region->allocate_pages();
-					}
-				}
-
-				uint64_t physical_addr = region->physical_start + (virtual_addr - region->virtual_start);
-				map_page(virtual_addr, physical_addr, region->flags);
-
-				if (region->managed_alloc) {
-					bzero((uint8_t*)physical_addr, PAGE_SIZE);
-				}
+	if (!region || (region->flags & flags) != flags) {
+		return -1;
+	}
 
-				page_table_mutex.unlock();
-				return;
+	int empty_level;
+	uint64_t* entry = get_page_table_entry(virtual_addr, empty_level);
+	if (!entry) {
+		if (map_fault(region, virtual_addr, flags, empty_level)) {
+			return -1;
+		}
+		__atomic_add_fetch(&fault_stats.faults, 1, __ATOMIC_RELAXED);
+		entry = get_page_table_entry(virtual_addr);
+	} else if ((flags & PAGE_W) && !(*entry & PAGE_W) &&
+		   (region->copy_on_write || is_zero_page(pte_to_physical(*entry)))) {
+		if (break_cow(region, virtual_addr, entry)) {
+			return -1;
+		}
+	}
+	if (!entry) {
+		return -1;
+	}
+
+	// Also covers faults on a stale invalid entry left in the TLB, say by a
+	// neighbour fault-around mapped without a flush.
+	flush_leaf(virtual_addr, *entry);
+	return 0;
+}
+
+int PageTable::migrate_page(uint64_t virtual_addr, uint64_t old_physical, uint64_t new_physical) {
+	if (!page_table_mutex.try_lock()) {
+		return -1;
+	}
+
+	int level;
+	uint64_t* entry = get_page_table_entry(virtual_addr, level);
+	if (!entry || level || pte_to_physical(*entry) != old_physical) {
+		page_table_mutex.unlock();
+		return -1;
+	}
+
+	uint64_t old_pte = *entry;
+	uint64_t new_pte = make_pte(new_physical, old_pte & ((1 << PTE_PPN_SHIFT) - 1));
+	TlbShootdown shootdown;
+	add_to_shootdown(shootdown, virtual_addr, PAGE_SIZE, old_pte);
+	// Other harts have to stop writing to the page before it's copied. Any
+	// write that faults meanwhile just retries until the new entry is in.
+	if ((old_pte & PAGE_W) && remote_harts()) {
+		uint64_t read_only = old_pte & ~(uint64_t)(PAGE_W | PAGE_D);
+		if (!__atomic_compare_exchange_n(entry, &old_pte, read_only, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			page_table_mutex.unlock();
+			return -1;
+		}
+		old_pte = read_only;
+		send_shootdown(shootdown);
+	}
+	lib::memcpy((uint8_t*)phys_to_virt(new_physical), (uint8_t*)phys_to_virt(old_physical), PAGE_SIZE);
+	// Faults don't hold the lock, so the entry may have changed under us.
+	if (!__atomic_compare_exchange_n(entry, &old_pte, new_pte, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		page_table_mutex.unlock();
+		return -1;
+	}
+	flush_leaf(virtual_addr, new_pte);
+	// The old page is freed as soon as we return.
+	send_shootdown(shootdown);
+
+	page_table_mutex.unlock();
+
+	return 0;
+}
+
+int PageTable::share_pages(PageTable* dest, uint64_t virtual_start, uint64_t virtual_end) {
+	if (dest == this) {
+		return -1;
+	}
+
+	begin_update();
+	dest->begin_update();
+
+	split_memory_regions(virtual_start, virtual_end);
+	lib::Queue<MemoryRegion*> regions;
+	find_contained_regions(virtual_start, virtual_end, regions);
+	MemoryRegion* region = nullptr;
+	bool shared_any = false;
+	int ret = 0;
+	while (!ret && regions.dequeue(region)) {
+		ret = share_region(region, dest);
+		shared_any |= region->managed_alloc;
+	}
+	// Our own leaves just lost their write permission, even if we stopped
+	// partway.
+	if (shared_any) {
+		flush_tlb_asid(local_asid());
+	}
+
+	dest->end_update();
+	end_update();
+
+	if (ret) {
+		io::printk("share_pages: Out of memory!\n");
+		io::print_stack_trace();
+	}
+	return ret;
+}
+
+PageTable* PageTable::clone() {
+	PageTable* copy = new PageTable();
+	if (!copy->root_page_table || share_pages(copy, 0, ~0ULL)) {
+		delete copy;
+		return nullptr;
+	}
+	return copy;
+}
+
+// Copies region and its leaves into dest. Managed pages end up shared
+// read-only between both tables, split down to 4K so each leaf can be
+// copied on its own. Caller must hold both locks. Returns -1 if either table
+// ran out of page tables, with the leaves so far already shared.
+int PageTable::share_region(MemoryRegion* region, PageTable* dest) {
+	if (dest->clear_memory_regions(region->virtual_start, region->virtual_end)) {
+		return -1;
+	}
+
+	MemoryRegion* copy;
+	if (!region->managed_alloc) {
+		copy = new MemoryRegion(region->virtual_start, region->virtual_end, region->physical_start, region->physical_end, region->flags);
+		copy->fault_around_pages = region->fault_around_pages;
+		dest->insert_memory_region(copy);
+		dest->map_range(region->virtual_start, region->virtual_end, region->physical_start, region->flags);
+		return 0;
+	}
+
+	region->copy_on_write = true;
+	copy = new MemoryRegion(region->virtual_start, region->virtual_end, region->flags);
+	copy->fault_around_pages = region->fault_around_pages;
+	copy->copy_on_write = true;
+	copy->pinned = region->pinned;
+	dest->insert_memory_region(copy);
+
+	uint64_t virtual_addr = region->virtual_start;
+	while (virtual_addr < region->virtual_end) {
+		int level;
+		uint64_t* entry = get_page_table_entry(virtual_addr, level);
+		uint64_t size = LEVEL_SIZE(level);
+		if (!entry) {
+			virtual_addr = (virtual_addr & ~(size - 1)) + size;
+			continue;
+		}
+		if (level) {
+			if (split_superpage(entry, virtual_addr & ~(size - 1), level)) {
+				return -1;
 			}
+			continue;
+		}
+
+		uint64_t* dest_entry = dest->get_or_create_page_table_entry(virtual_addr, 0);
+		if (!dest_entry) {
+			return -1;
 		}
+		if (!is_zero_page(pte_to_physical(*entry))) {
+			share_page(pte_to_physical(*entry));
+		}
+		if (*entry & PAGE_W) {
+			add_to_shootdown(pending_shootdown, virtual_addr, PAGE_SIZE, *entry);
+		}
+		*entry &= ~(uint64_t)(PAGE_W | PAGE_D);
+		*dest_entry = *entry;
+		virtual_addr += PAGE_SIZE;
 	}
 
-	io::printk("Unexpected page fault!\n");
-	io::print_stack_trace();
+	return 0;
+}
+
+// Write fault on a read-only leaf of a copy-on-write region, or on the zero
+// page. The page is copied unless this table holds the only reference left,
+// in which case it just becomes writable again. The zero page is replaced
+// with a fresh zeroed page instead.
+int PageTable::break_cow(MemoryRegion* region, uint64_t virtual_addr, uint64_t* entry) {
+	uint64_t page_addr = virtual_addr & ~((uint64_t)PAGE_SIZE - 1);
+	uint64_t old_pte = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+	if (old_pte & PAGE_W) {
+		return 0;
+	}
+
+	uint64_t old_physical = pte_to_physical(old_pte);
+	uint64_t new_physical = old_physical;
+	bool was_zero = is_zero_page(old_physical);
+	if (was_zero) {
+		PageBlock fresh;
+		if (allocate_page_block(PAGE_SIZE, fresh, PAGE_BLOCK_ZERO)) {
+			return -1;
+		}
+		new_physical = fresh.start;
+	} else if (is_page_shared(old_physical)) {
+		PageBlock copy;
+		if (allocate_page_block(PAGE_SIZE, copy)) {
+			return -1;
+		}
+		lib::memcpy((uint8_t*)phys_to_virt(copy.start), (uint8_t*)phys_to_virt(old_physical), PAGE_SIZE);
+		new_physical = copy.start;
+	}
+
+	// Another fault on the same page may have beaten us to it.
+	uint64_t new_pte = make_pte(new_physical, leaf_flags(region->flags));
+	if (!__atomic_compare_exchange_n(entry, &old_pte, new_pte, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (new_physical != old_physical) {
+			release_page(new_physical);
+		}
+		return 0;
+	}
+
+	flush_leaf(page_addr, new_pte);
+	if (new_physical != old_physical) {
+		// Other harts may still be reading the old page.
+		TlbShootdown shootdown;
+		add_to_shootdown(shootdown, page_addr, PAGE_SIZE, old_pte);
+		send_shootdown(shootdown);
+		if (!was_zero) {
+			release_page(old_physical);
+			__atomic_add_fetch(&fault_stats.cow_copies, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (!region->pinned) {
+		set_page_owner(new_physical, this, page_addr);
+	}
 
+	return 0;
+}
+
+int PageTable::set_fault_around(uint64_t virtual_addr, uint64_t num_pages) {
+	if (num_pages > LEVEL_SIZE(1) / PAGE_SIZE) {
+		num_pages = LEVEL_SIZE(1) / PAGE_SIZE;
+	}
+	uint64_t window = 1;
+	while (window * 2 <= num_pages) {
+		window *= 2;
+	}
+
+	page_table_mutex.lock();
+	MemoryRegion* region = find_memory_region(virtual_addr);
+	if (!region) {
+		page_table_mutex.unlock();
+		return -1;
+	}
+	region->fault_around_pages = window;
 	page_table_mutex.unlock();
 
-	use_page_table();
+	return 0;
+}
+
+int PageTable::set_pinned(uint64_t virtual_addr) {
+	page_table_mutex.lock();
+	MemoryRegion* region = find_memory_region(virtual_addr);
+	if (!region) {
+		page_table_mutex.unlock();
+		return -1;
+	}
+	region->pinned = true;
+	page_table_mutex.unlock();
+
+	return 0;
+}
+
+// Structural changes take the lock and then wait for every fault that may
+// be looking at the old tree to finish. Faults arriving meanwhile see
+// updating set and queue up on the lock.
+void PageTable::begin_update() {
+	page_table_mutex.lock();
+	__atomic_store_n(&updating, true, __ATOMIC_SEQ_CST);
+	thread::synchronize_rcu();
+}
+
+void PageTable::end_update() {
+	flush_pending();
+	__atomic_store_n(&updating, false, __ATOMIC_RELEASE);
+	page_table_mutex.unlock();
+}
+
+void PageTable::get_fault_stats(PageFaultStats& stats) {
+	page_table_mutex.lock();
+	stats = fault_stats;
+	page_table_mutex.unlock();
 }
 
 void PageTable::use_page_table() {
-	uint64_t satp_val = (((uint64_t)root_page_table)/PAGE_SIZE) | PAGING_39_BIT;
-	asm volatile(
-		"csrw %1, %0		\n"
-		: "+r"(satp_val)
-		: "i"(CSR_SATP)
-		:);
+	uint64_t satp = (root_page_table / PAGE_SIZE) | (SATP_MODE(paging_levels) << SATP_MODE_SHIFT);
+
+	asid_mutex.lock();
+	if (!num_asids) {
+		num_asids = probe_num_asids(satp);
+	}
+	if (num_asids > 1 && asid_generation != current_generation) {
+		if (next_asid == num_asids) {
+			// Out of ASIDs. Every hart flushes its whole TLB once it sees the
+			// new generation, after which they can all be reused.
+			current_generation++;
+			next_asid = 1;
+		}
+		asid = next_asid++;
+		asid_generation = current_generation;
+	}
+	uint64_t generation = current_generation;
+	thread::HartState* hart_state = thread::get_hart_state();
+	PageTable* previous = nullptr;
+	if (hart_state) {
+		hart_asids[hart_state->hart_id] = asid;
+		__atomic_or_fetch(&active_harts, 1ULL << hart_state->hart_id, __ATOMIC_SEQ_CST);
+		previous = hart_tables[hart_state->hart_id];
+		hart_tables[hart_state->hart_id] = this;
+	}
+	asid_mutex.unlock();
+
+	write_satp(satp | (asid << SATP_ASID_SHIFT));
+
+	// Shootdowns for the old table stop reaching this hart once its bit is
+	// clear, so whatever it still caches for that table has to go too.
+	if (previous == this) {
+		previous = nullptr;
+	}
+	if (previous) {
+		__atomic_and_fetch(&previous->active_harts, ~(1ULL << hart_state->hart_id), __ATOMIC_SEQ_CST);
+	}
+
+	// Entries for other ASIDs can stay cached unless this hart hasn't flushed
+	// since the last rollover. Without ASIDs every switch has to flush.
+	if (num_asids <= 1 || !hart_state || hart_generations[hart_state->hart_id] != generation) {
+		flush_tlb();
+		if (hart_state) {
+			hart_generations[hart_state->hart_id] = generation;
+		}
+	} else if (previous) {
+		flush_tlb_asid(previous->hart_asids[hart_state->hart_id]);
+	}
 }
 
-static void PageTable::disable_paging() {
-	asm volatile(
-		"csrw %0, zero		\n"
-		:
-		: "i"(CSR_SATP)
-		:);
+// The ASID this hart tags the table's entries with. A hart that loaded the
+// table before a rollover keeps the old ASID until it next switches.
+uint64_t PageTable::local_asid() {
+	uint64_t satp = read_satp();
+	if ((satp & SATP_PPN_MASK) == root_page_table / PAGE_SIZE) {
+		return (satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+	}
+	return asid;
 }
 
-void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags) {
-	PageBlock new_table;
-	virtual_addr >>= 12;
-	if (!root_page_table[virtual_addr & 0x1FF]) {
-		if (allocate_page_block(PAGE_SIZE, new_table)) {
-			io::printk("Error allocating page table entry!\n");
-			io::print_stack_trace();
+// Flushes the calling hart's translation for the leaf pte mapped (or maps)
+// at virtual_addr.
+void PageTable::flush_leaf(uint64_t virtual_addr, uint64_t pte) {
+	if (pte & PAGE_G) {
+		flush_tlb_global_page(virtual_addr);
+	} else {
+		flush_tlb_page(virtual_addr, local_asid());
+	}
+}
+
+// Harts other than this one that have loaded the table, and so may have its
+// translations cached.
+uint64_t PageTable::remote_harts() {
+	uint64_t hart_mask = __atomic_load_n(&active_harts, __ATOMIC_ACQUIRE);
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (hart_state) {
+		hart_mask &= ~(1ULL << hart_state->hart_id);
+	}
+	return hart_mask;
+}
+
+// Fences the gathered range on every other hart that has run the table, all
+// with a single SBI call. The calling hart flushes its own entries as it
+// changes them.
+void PageTable::send_shootdown(TlbShootdown& shootdown) {
+	uint64_t hart_mask = remote_harts();
+	if (!shootdown.num_leaves || !hart_mask) {
+		return;
+	}
+
+	uint64_t start = shootdown.start;
+	uint64_t size = shootdown.end - shootdown.start;
+	if (shootdown.num_leaves > TLB_FLUSH_LEAF_LIMIT) {
+		start = 0;
+		size = SFENCE_ALL;
+	}
+
+	// A hart that hasn't switched tables since an ASID rollover still tags
+	// our entries with the old ASID, in which case every ASID is fenced.
+	bool one_asid = !shootdown.global;
+	uint64_t remote_asid = 0;
+	bool first = true;
+	for (uint64_t hart_id = 0; hart_id < MAX_HART; hart_id++) {
+		if (!(hart_mask & (1ULL << hart_id))) {
+			continue;
+		}
+		if (first) {
+			remote_asid = hart_asids[hart_id];
+			first = false;
+		} else if (hart_asids[hart_id] != remote_asid) {
+			one_asid = false;
+		}
+	}
+
+	// The cleared entries must be visible before the other harts fence.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (one_asid) {
+		thread::remote_sfence_vma_asid(hart_mask, start, size, remote_asid);
+	} else {
+		thread::remote_sfence_vma(hart_mask, start, size);
+	}
+}
+
+// Sends the shootdown gathered under the lock, after which the pages it
+// unmapped can finally be freed.
+void PageTable::flush_pending() {
+	send_shootdown(pending_shootdown);
+	pending_shootdown = TlbShootdown();
+	PageBlock to_free;
+	while (pending_frees.dequeue(to_free)) {
+		free_leaf_block(to_free);
+	}
+}
+
+// Installs a leaf at the given level. Anything previously mapped underneath
+// that entry is discarded.
+void PageTable::map_page(uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags, int level) {
+	uint64_t* entry = get_or_create_page_table_entry(virtual_addr, level);
+	if (!entry) {
+		return;
+	}
+
+	if ((*entry & PAGE_V) && !is_leaf(*entry)) {
+		free_page_table(pte_to_physical(*entry), level - 1);
+	}
+	*entry = make_pte(physical_addr, leaf_flags(flags));
+}
+
+// Maps a physically contiguous range using the largest leaves the alignment of
+// both ranges allows.
+void PageTable::map_range(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint16_t flags) {
+	uint64_t virtual_addr = virtual_start;
+	uint64_t physical_addr = physical_start;
+	while (virtual_addr < virtual_end) {
+		int level = fit_leaf_level(virtual_addr, virtual_end, virtual_addr, physical_addr);
+		map_page(virtual_addr, physical_addr, flags, level);
+		virtual_addr += LEVEL_SIZE(level);
+		physical_addr += LEVEL_SIZE(level);
+	}
+}
+
+// Maps the leaf covering virtual_addr inside region, where empty_level is the
+// level of the invalid entry the walk stopped at. Managed regions are backed
+// with a pre-zeroed megapage if one fits and the pool has one, otherwise a
+// single zeroed page. Reads
+// just get the zero page, read-only, until they're written to.
+int PageTable::map_fault(MemoryRegion* region, uint64_t virtual_addr, uint16_t flags, int empty_level) {
+	uint64_t physical_addr;
+	uint16_t pte_flags = region->flags;
+	int level;
+	uint64_t zero = 0;
+	if (region->managed_alloc && !(flags & PAGE_W)) {
+		zero = get_zero_page();
+	}
+	if (zero) {
+		level = 0;
+		physical_addr = zero;
+		pte_flags &= ~PAGE_W;
+	} else if (region->managed_alloc) {
+		level = fit_leaf_level(region->virtual_start, region->virtual_end, virtual_addr, virtual_addr);
+		if (level > 1) {
+			level = 1;
+		}
+		if (level > empty_level) {
+			level = empty_level;
+		}
+		PageBlock backing;
+		// Megapages are only worth it if one is already zeroed, never 2M of
+		// bzero on the fault path.
+		if (level && allocate_page_block(MEGAPAGE_SIZE, backing, PAGE_BLOCK_HUGE | PAGE_BLOCK_ZERO | PAGE_BLOCK_POOLED)) {
+			level = 0;
+		}
+		if (!level && allocate_page_block(PAGE_SIZE, backing, PAGE_BLOCK_ZERO)) {
+			return -1;
+		}
+		physical_addr = backing.start + (virtual_addr & (LEVEL_SIZE(level) - 1));
+	} else {
+		physical_addr = region->physical_start + (virtual_addr - region->virtual_start);
+
+		// Map the largest leaf that fits the region without clobbering
+		// anything that's already mapped.
+		level = fit_leaf_level(region->virtual_start, region->virtual_end, virtual_addr, physical_addr);
+		if (level > empty_level) {
+			level = empty_level;
+		}
+	}
+
+	uint64_t mask = LEVEL_SIZE(level) - 1;
+	if (!install_leaf(virtual_addr & ~mask, make_pte(physical_addr & ~mask, leaf_flags(pte_flags)), level)) {
+		// Another hart mapped it first.
+		if (region->managed_alloc && !zero) {
+			PageBlock backing;
+			backing.start = physical_addr & ~mask;
+			backing.size = LEVEL_SIZE(level);
+			free_page_block(backing);
+		}
+		return 0;
+	}
+	if (zero) {
+		__atomic_add_fetch(&fault_stats.zero_page_maps, 1, __ATOMIC_RELAXED);
+	}
+	if (!level) {
+		if (region->managed_alloc && !zero && !region->pinned) {
+			// Single pages are only referenced from this leaf, so compaction
+			// can move them.
+			set_page_owner(physical_addr & ~mask, this, virtual_addr & ~mask);
+		}
+		fault_around(region, virtual_addr, zero);
+	}
+
+	return 0;
+}
+
+// Installs a leaf into an empty entry without the lock, creating missing
+// tables on the way down. Returns false without touching anything if another
+// hart got any part of the way there first with a leaf of its own.
+bool PageTable::install_leaf(uint64_t virtual_addr, uint64_t pte, int level) {
+	uint64_t* root = table_at(root_page_table);
+	switch (paging_levels) {
+		case 5:
+			return install_leaf_at<4>(root, virtual_addr, pte, level);
+		case 4:
+			return install_leaf_at<3>(root, virtual_addr, pte, level);
+		default:
+			return install_leaf_at<2>(root, virtual_addr, pte, level);
+	}
+}
+
+// Maps the rest of the aligned fault-around window after a 4K fault at
+// virtual_addr, leaving alone anything that's already mapped. Managed pages
+// only come out of the zero pool, so neighbours are mapped with pages idle
+// harts already zeroed and never zeroed on the spot. Once the pool is dry
+// the rest of the window is left to fault on its own.
+// If zero is set the fault was a read that got the zero page, and so do its
+// neighbours.
+void PageTable::fault_around(MemoryRegion* region, uint64_t virtual_addr, uint64_t zero) {
+	if (region->fault_around_pages <= 1) {
+		return;
+	}
+
+	// The window never crosses a 2M boundary, so it all sits in the table
+	// the fault was just mapped into.
+	uint64_t window_size = (uint64_t)region->fault_around_pages * PAGE_SIZE;
+	uint64_t window_start = virtual_addr & ~(window_size - 1);
+	uint64_t window_end = window_start + window_size;
+	if (window_start < region->virtual_start) {
+		window_start = region->virtual_start;
+	}
+	if (window_end > region->virtual_end) {
+		window_end = region->virtual_end;
+	}
+	int level;
+	uint64_t* entry = get_page_table_entry(virtual_addr, level);
+	if (!entry || level) {
+		return;
+	}
+	uint64_t* table = entry - VPN(virtual_addr, 0);
+
+	for (uint64_t addr = window_start; addr < window_end; addr += PAGE_SIZE) {
+		entry = table + VPN(addr, 0);
+		if (__atomic_load_n(entry, __ATOMIC_RELAXED) & PAGE_V) {
+			continue;
+		}
+
+		PageBlock backing;
+		uint64_t physical_addr;
+		uint16_t pte_flags = region->flags;
+		bool owned = region->managed_alloc && !zero;
+		if (zero) {
+			physical_addr = zero;
+			pte_flags &= ~PAGE_W;
+		} else if (region->managed_alloc) {
+			if (allocate_page_block(PAGE_SIZE, backing, PAGE_BLOCK_ZERO | PAGE_BLOCK_POOLED)) {
+				return;
+			}
+			physical_addr = backing.start;
+		} else {
+			physical_addr = region->physical_start + (addr - region->virtual_start);
+		}
+
+		uint64_t empty = 0;
+		if (!__atomic_compare_exchange_n(entry, &empty, make_pte(physical_addr, leaf_flags(pte_flags)), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			if (owned) {
+				free_page_block(backing);
+			}
+			continue;
+		}
+		if (owned && !region->pinned) {
+			set_page_owner(physical_addr, this, addr);
+		}
+		if (zero) {
+			__atomic_add_fetch(&fault_stats.zero_page_maps, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&fault_stats.faults_avoided, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Clears every leaf in the range, splitting superpages that straddle either
+// end. If free_pages is set the pages behind the leaves go back to the page
+// allocator. Returns -1 if a superpage couldn't be split, with the range only
+// unmapped up to it.
+int PageTable::unmap_range(uint64_t virtual_start, uint64_t virtual_end, bool free_pages) {
+	int ret = 0;
+	uint64_t num_leaves = 0;
+	bool any_global = false;
+	uint64_t virtual_addr = virtual_start;
+	while (virtual_addr < virtual_end) {
+		int level;
+		uint64_t* entry = get_page_table_entry(virtual_addr, level);
+		uint64_t size = LEVEL_SIZE(level);
+		uint64_t window = virtual_addr & ~(size - 1);
+		if (!entry) {
+			virtual_addr = window + size;
+			continue;
+		}
+
+		if (window < virtual_start || window + size > virtual_end) {
+			if (split_superpage(entry, window, level)) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		uint64_t pte = *entry;
+		*entry = 0;
+		// Small unmaps flush leaf by leaf, big ones all at once at the end.
+		if (num_leaves++ < TLB_FLUSH_LEAF_LIMIT) {
+			flush_leaf(window, pte);
+		}
+		any_global |= pte & PAGE_G;
+		add_to_shootdown(pending_shootdown, window, size, pte);
+		if (free_pages) {
+			PageBlock to_free;
+			to_free.start = pte_to_physical(pte);
+			to_free.size = size;
+			// Other harts can still reach the page until they're fenced.
+			if (remote_harts()) {
+				pending_frees.enqueue(to_free);
+			} else {
+				free_leaf_block(to_free);
+			}
 		}
-		root_page_table[virtual_addr & 0x1FF] = new_table.start << 10;
-		bzero((uint8_t*)new_table.start, PAGE_SIZE);
+		virtual_addr = window + size;
 	}
 
-	uint64_t* entry = root_page_table[virtual_addr & 0x1FF];
-	virtual_addr >>= 9;
-	if (!entry[virtual_addr & 0x1FF]) {
-		if (allocate_page_block(PAGE_SIZE, new_table)) {
+	if (num_leaves > TLB_FLUSH_LEAF_LIMIT) {
+		if (any_global) {
+			flush_tlb();
+		} else {
+			flush_tlb_asid(local_asid());
+		}
+	}
+
+	return ret;
+}
+
+uint64_t* PageTable::get_page_table_entry(uint64_t virtual_addr) {
+	int level;
+	return get_page_table_entry(virtual_addr, level);
+}
+
+// Returns the leaf entry mapping virtual_addr, or nullptr if it isn't mapped.
+// Level is set to the level of the leaf, or to the level of the first invalid
+// entry the walk ran into.
+uint64_t* PageTable::get_page_table_entry(uint64_t virtual_addr, int& level) {
+	uint64_t* root = table_at(root_page_table);
+	switch (paging_levels) {
+		case 5:
+			return find_leaf<4>(root, virtual_addr, level);
+		case 4:
+			return find_leaf<3>(root, virtual_addr, level);
+		default:
+			return find_leaf<2>(root, virtual_addr, level);
+	}
+}
+
+template <int curr_level>
+uint64_t* PageTable::create_entry(uint64_t* table, uint64_t virtual_addr, int level) {
+	uint64_t* entry = table + VPN(virtual_addr, curr_level);
+	if (curr_level == level) {
+		return entry;
+	}
+
+	if (!(*entry & PAGE_V)) {
+		PageBlock new_table;
+		if (allocate_page_block(PAGE_SIZE, new_table, PAGE_BLOCK_ZERO)) {
 			io::printk("Error allocating page table entry!\n");
 			io::print_stack_trace();
+			return nullptr;
 		}
-		entry[virtual_addr & 0x1FF] = new_table.start << 10;
-		bzero((uint8_t*)new_table.start, PAGE_SIZE);
+		*entry = make_pte(new_table.start, 0);
+	} else if (is_leaf(*entry) && split_superpage(entry, virtual_addr & ~(LEVEL_SIZE(curr_level) - 1), curr_level)) {
+		return nullptr;
+	}
+	return create_entry<curr_level - 1>(table_at(pte_to_physical(*entry)), virtual_addr, level);
+}
+
+template <>
+uint64_t* PageTable::create_entry<-1>(uint64_t* table, uint64_t virtual_addr, int level) {
+	return nullptr;
+}
+
+// Walks down to the entry for virtual_addr at the given level, allocating
+// intermediate tables and splitting superpages in the way.
+uint64_t* PageTable::get_or_create_page_table_entry(uint64_t virtual_addr, int level) {
+	uint64_t* root = table_at(root_page_table);
+	switch (paging_levels) {
+		case 5:
+			return create_entry<4>(root, virtual_addr, level);
+		case 4:
+			return create_entry<3>(root, virtual_addr, level);
+		default:
+			return create_entry<2>(root, virtual_addr, level);
+	}
+}
+
+// Replaces a superpage leaf with a table of leaves one level down that map
+// the same memory with the same permissions. Returns -1, leaving the
+// superpage alone, if the new table couldn't be allocated.
+int PageTable::split_superpage(uint64_t* entry, uint64_t virtual_addr, int level) {
+	PageBlock new_table;
+	if (allocate_page_block(PAGE_SIZE, new_table)) {
+		io::printk("Error allocating page table entry!\n");
+		io::print_stack_trace();
+		return -1;
 	}
 
-	entry = entry[virtual_addr & 0x1FF];
-	virtual_addr >>= 9;
-	entry[virtual_addr & 0x1FF] = (physical_addr << 10) | flags | 1;
+	uint64_t* table = table_at(new_table.start);
+	uint64_t physical_addr = pte_to_physical(*entry);
+	uint16_t flags = *entry & ((1 << PTE_PPN_SHIFT) - 1);
+	for (int i = 0; i < 512; i++) {
+		table[i] = make_pte(physical_addr + i * LEVEL_SIZE(level - 1), flags);
+	}
+	uint64_t old_pte = *entry;
+	*entry = make_pte(new_table.start, 0);
+
+	flush_leaf(virtual_addr, old_pte);
+
+	return 0;
 }
 
-uint64_t* get_page_table_entry(uint64_t virtual_addr) {
-	virtual_addr >>= 12;
-	uint64_t* entry = root_page_table;
-	int i = 0;
-	while(i < 2 &&
-	      entry[virtual_addr & 0x1FF] && 
-	      !(entry[virtual_addr & 0x1FF] & (PAGE_R | PAGE_W | PAGE_X))) {
-		entry = (uint64_t*)((entry[virtual_addr & 0x1FF] >> 10) & 0x7FFFFFFFF);
-		virtual_addr >>= 9;
-		i++;
+void PageTable::free_page_table(uint64_t table_addr, int level) {
+	uint64_t* table = table_at(table_addr);
+	if (level > 0) {
+		for (int i = 0; i < 512; i++) {
+			if ((table[i] & PAGE_V) && !is_leaf(table[i])) {
+				free_page_table(pte_to_physical(table[i]), level - 1);
+			}
+		}
 	}
 
-	return entry + (virtual_addr & 0x1FF);
+	PageBlock to_free;
+	to_free.start = table_addr;
+	to_free.size = PAGE_SIZE;
+	free_page_block(to_free);
 }
 
-void PageTable::insert_memory_region_helper(MemoryRegion* node, MemoryRegion* to_insert) {
-	if (!root_memory_region) {
-		root_memory_region = node;
+void PageTable::free_memory_regions(MemoryRegion* node) {
+	if (!node) {
 		return;
 	}
+	free_memory_regions(node->left);
+	free_memory_regions(node->right);
+	if (node->managed_alloc) {
+		unmap_range(node->virtual_start, node->virtual_end, true);
+	}
+	delete node;
+}
 
-	if (node->virtual_start <= to_insert->virtual_start) {
-		if (node->left) {
-			insert_memory_region_helper(node->left, to_insert);
-		} else {
-			node->left = to_insert;
-			to_insert->parent = node;
+void PageTable::rotate_left(MemoryRegion* node) {
+	MemoryRegion* child = node->right;
+	node->right = child->left;
+	if (child->left) {
+		child->left->parent = node;
+	}
+	replace_memory_region(node, child);
+	child->left = node;
+	node->parent = child;
+	update_max_end(node);
+	update_max_end(child);
+}
+
+void PageTable::rotate_right(MemoryRegion* node) {
+	MemoryRegion* child = node->left;
+	node->left = child->right;
+	if (child->right) {
+		child->right->parent = node;
+	}
+	replace_memory_region(node, child);
+	child->right = node;
+	node->parent = child;
+	update_max_end(node);
+	update_max_end(child);
+}
+
+// The range covered by to_insert must already be cleared of other regions.
+void PageTable::insert_memory_region(MemoryRegion* to_insert) {
+	to_insert->left = nullptr;
+	to_insert->right = nullptr;
+	to_insert->red = true;
+	to_insert->max_end = to_insert->virtual_end;
+
+	MemoryRegion* parent = nullptr;
+	MemoryRegion* curr = root_memory_region;
+	while (curr) {
+		parent = curr;
+		if (curr->max_end < to_insert->virtual_end) {
+			curr->max_end = to_insert->virtual_end;
 		}
+		curr = to_insert->virtual_start < curr->virtual_start ? curr->left : curr->right;
+	}
+
+	to_insert->parent = parent;
+	if (!parent) {
+		root_memory_region = to_insert;
+	} else if (to_insert->virtual_start < parent->virtual_start) {
+		parent->left = to_insert;
 	} else {
-		if (node->right) {
-			insert_memory_region_helper(node->right, to_insert);
+		parent->right = to_insert;
+	}
+	insert_fixup(to_insert);
+}
+
+void PageTable::insert_fixup(MemoryRegion* node) {
+	while (is_red(node->parent)) {
+		MemoryRegion* parent = node->parent;
+		// The root is black, so a red parent always has a parent of its own.
+		MemoryRegion* grandparent = parent->parent;
+		if (parent == grandparent->left) {
+			MemoryRegion* uncle = grandparent->right;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rotate_left(parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rotate_right(grandparent);
 		} else {
-			node->right = to_insert;
-			to_insert->parent = node;
+			MemoryRegion* uncle = grandparent->left;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rotate_right(parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rotate_left(grandparent);
 		}
 	}
+	root_memory_region->red = false;
 }
 
-void PageTable::insert_memory_region(MemoryRegion* to_insert) {
-	if (root_memory_region) {
-		// Delete all regions that are completely overlapped.
-		lib::Queue<MemoryRegion*> contained_regions;
-		find_contained_regions(to_insert->virtual_start, to_insert->virtual_end, contained_regions);
-		MemoryRegion* to_remove = nullptr;
-		while(contained_regions.dequeue(to_remove)) {
-			remove_memory_region(to_remove);
-		}
-
-		// Find region that is split on the lower bound.
-		MemoryRegion* to_split = find_memory_region(to_insert->virtual_start);
-		if (to_split) {
-			MemoryRegion discard(to_insert->virtual_start, to_split->virtual_end, to_split->managed_alloc);
-			to_split->virtual_end = to_insert->virtual_start;
-			to_split->physical_end = to_split->physical_start + (to_split->virtual_end - to_split->virtual_start);
-			if (to_split->virtual_end <= to_insert->virtual_end) {
-				// Find a region that is split on the upper bound.
-				to_split = find_memory_region(to_insert->virtual_end);
-				if (to_split) {
-					MemoryRegion discard(to_split->virtual_start, to_insert->virtual_end, to_split->managed_alloc);
-					to_split->virtual_start = to_insert->virtual_end;
-					to_split->physical_end = to_split->physical_start + (to_split->virtual_end - to_split->virtual_start);
-				}
-			} else {
-				// We're actually splitting the same region twice, handle this specially.
-				discard.virtual_end = to_insert->virtual_end;
-				MemoryRegion* new_right_region = new MemoryRegion(to_insert->virtual_end, to_split->virtual_end,
-										  to_split->physical_end - (to_split->virtual_end - to_insert->virtual_end),
-										  to_split->physical_end,
-										  to_split->flags,
-										  to_split->managed_alloc);
-				insert_memory_region_helper(root_memory_region, new_right_region);
-			}
+// Removes the given range from the memory map, splitting regions that straddle
+// either end. Returns -1 if a region couldn't be fully unmapped, in which case
+// it and the regions after it are left in place.
+int PageTable::clear_memory_regions(uint64_t virtual_start, uint64_t virtual_end) {
+	split_memory_regions(virtual_start, virtual_end);
+
+	// Everything left overlapping the range is completely contained in it.
+	lib::Queue<MemoryRegion*> contained_regions;
+	find_contained_regions(virtual_start, virtual_end, contained_regions);
+	MemoryRegion* to_remove = nullptr;
+	while(contained_regions.dequeue(to_remove)) {
+		if (unmap_range(to_remove->virtual_start, to_remove->virtual_end, to_remove->managed_alloc)) {
+			return -1;
 		}
-	
-		insert_memory_region_helper(root_memory_region, to_insert);
+		remove_memory_region(to_remove);
+	}
+
+	return 0;
+}
+
+// Splits the regions straddling either end of the range, so every region
+// overlapping it is completely contained in it.
+void PageTable::split_memory_regions(uint64_t virtual_start, uint64_t virtual_end) {
+	MemoryRegion* to_split = find_memory_region(virtual_start);
+	if (to_split && to_split->virtual_start < virtual_start) {
+		MemoryRegion* upper = to_split->split(virtual_start);
+		update_max_end_path(to_split);
+		insert_memory_region(upper);
+	}
+
+	to_split = find_memory_region(virtual_end - 1);
+	if (to_split && to_split->virtual_end > virtual_end) {
+		MemoryRegion* upper = to_split->split(virtual_end);
+		update_max_end_path(to_split);
+		insert_memory_region(upper);
+	}
+}
+
+void PageTable::replace_memory_region(MemoryRegion* node, MemoryRegion* replacement) {
+	if (!node->parent) {
+		root_memory_region = replacement;
+	} else if (node == node->parent->left) {
+		node->parent->left = replacement;
 	} else {
-		root_memory_region = to_insert;
+		node->parent->right = replacement;
+	}
+	if (replacement) {
+		replacement->parent = node->parent;
 	}
 }
 
-void remove_memory_region(MemoryRegion* node) {
-	MemoryRegion* parent = node->parent;
-	MemoryRegion* primary_subtree = nullptr;
-	MemoryRegion* secondary_subtree = nullptr;
-	if (node->left) {
-		primary_subtree = node->left;
-		secondary_subtree = node->right;
+void PageTable::remove_memory_region(MemoryRegion* node) {
+	// child takes the place of whichever node actually leaves the tree. It may
+	// be null, so its parent is tracked separately.
+	MemoryRegion* child;
+	MemoryRegion* child_parent;
+	bool removed_red = node->red;
+	if (!node->left) {
+		child = node->right;
+		child_parent = node->parent;
+		replace_memory_region(node, child);
+	} else if (!node->right) {
+		child = node->left;
+		child_parent = node->parent;
+		replace_memory_region(node, child);
 	} else {
-		primary_subtree = node->right;
-		secondary_subtree = node->left;
+		MemoryRegion* successor = node->right;
+		while (successor->left) {
+			successor = successor->left;
+		}
+		removed_red = successor->red;
+		child = successor->right;
+		if (successor->parent == node) {
+			child_parent = successor;
+		} else {
+			child_parent = successor->parent;
+			replace_memory_region(successor, successor->right);
+			successor->right = node->right;
+			successor->right->parent = successor;
+		}
+		replace_memory_region(node, successor);
+		successor->left = node->left;
+		successor->left->parent = successor;
+		successor->red = node->red;
 	}
-	if (parent) {
+
+	// The successor, if it moved, is on this path too.
+	update_max_end_path(child_parent);
+	if (!removed_red) {
+		remove_fixup(child, child_parent);
+	}
+	delete node;
+}
+
+void PageTable::remove_fixup(MemoryRegion* node, MemoryRegion* parent) {
+	while (node != root_memory_region && !is_red(node)) {
+		// node is one black short, so its sibling can't be null.
 		if (node == parent->left) {
-			parent->left = primary_subtree;
+			MemoryRegion* sibling = parent->right;
+			if (is_red(sibling)) {
+				sibling->red = false;
+				parent->red = true;
+				rotate_left(parent);
+				sibling = parent->right;
+			}
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rotate_right(sibling);
+				sibling = parent->right;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rotate_left(parent);
 		} else {
-			parent->right = primary_subtree;
+			MemoryRegion* sibling = parent->left;
+			if (is_red(sibling)) {
+				sibling->red = false;
+				parent->red = true;
+				rotate_right(parent);
+				sibling = parent->left;
+			}
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rotate_left(sibling);
+				sibling = parent->left;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rotate_right(parent);
 		}
-	} else {
-		root_memory_region = primary_subtree;
+		node = root_memory_region;
 	}
-	if (secondary_subtree) {
-		insert_memory_region_helper(parent, secondary_subtree);
+	if (node) {
+		node->red = false;
 	}
-	delete node;
 }
 
-void find_contained_regions(uint64_t virtual_start, uint64_t virtual_end, lib::Queue<MemoryRegion*>& ret) {
+void PageTable::find_contained_regions(uint64_t virtual_start, uint64_t virtual_end, lib::Queue<MemoryRegion*>& ret) {
 	find_contained_regions(root_memory_region, virtual_start, virtual_end, ret);
 }
 
-void find_contained_regions(MemoryRegion* node, uint64_t virtual_start, uint64_t virtual_end, lib::Queue<MemoryRegion*>& ret) {
-	if (!node) {
+void PageTable::find_contained_regions(MemoryRegion* node, uint64_t virtual_start, uint64_t virtual_end, lib::Queue<MemoryRegion*>& ret) {
+	if (!node || node->max_end <= virtual_start) {
 		return;
-	} else if (node->virtual_start >= virtual_start && node->virtual_end <= virtual_end) {
-		find_contained_regions(node->left, virtual_start, virtual_end, ret);
-		ret->enqueue(node);
-		find_contained_regions(node->right, virtual_start, virtual_end, ret);
-	} else if (virtual_end >= node->virtual_end) {
+	}
+	if (node->virtual_start > virtual_start) {
 		find_contained_regions(node->left, virtual_start, virtual_end, ret);
-	} else {
+	}
+	if (node->virtual_start >= virtual_start && node->virtual_end <= virtual_end) {
+		ret.enqueue(node);
+	}
+	if (node->virtual_end < virtual_end) {
 		find_contained_regions(node->right, virtual_start, virtual_end, ret);
 	}
 }
@@ -315,9 +1584,9 @@ MemoryRegion* PageTable::find_memory_region(uint64_t virtual_addr) {
 MemoryRegion* PageTable::find_memory_region(MemoryRegion* node, uint64_t virtual_addr) {
 	if (!node) {
 		return nullptr;
-	} else if (node->virtual_start <= virtual_addr && node->virtual_end >= virtual_addr) {
+	} else if (node->virtual_start <= virtual_addr && node->virtual_end > virtual_addr) {
 		return node;
-	} else if (node->virtual_end < virtual_addr) {
+	} else if (node->virtual_end <= virtual_addr) {
 		return find_memory_region(node->right, virtual_addr);
 	} else {
 		return find_memory_region(node->left, virtual_addr);
@@ -329,7 +1598,7 @@ MemoryRegion* PageTable::find_memory_region(MemoryRegion* node, uint64_t virtual
 		return nullptr;
 	} else if (virtual_start == node->virtual_start && virtual_end == node->virtual_end) {
 		return node;
-	} else if (virtual_start <= node->virtual_start) {
+	} else if (virtual_start < node->virtual_start) {
 		return find_memory_region(node->left, virtual_start, virtual_end);
 	} else {
 		return find_memory_region(node->right, virtual_start, virtual_end);
@@ -340,4 +1609,23 @@ MemoryRegion* PageTable::find_memory_region(uint64_t virtual_start, uint64_t vir
 	return find_memory_region(root_memory_region, virtual_start, virtual_end);
 }
 
+void initialize_paging() {
+	// Physical memory is identity mapped in the low half of the address space.
+	uint64_t memory_end = get_memory_end();
+	for (int levels = MIN_PAGING_LEVELS; levels <= MAX_PAGING_LEVELS; levels++) {
+		if (memory_end <= LEVEL_SIZE(levels) / 2 && probe_paging_mode(levels)) {
+			paging_levels = levels;
+			io::printk("Paging mode Sv%d\n", 12 + 9 * levels);
+			return;
+		}
+	}
+
+	io::printk("No paging mode covers memory up to %x!\n", memory_end);
+	io::print_stack_trace();
+}
+
+int get_paging_levels() {
+	return paging_levels;
+}
+
 } // namespace memory
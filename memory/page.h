@@ -4,8 +4,12 @@
 #include <stdint.h>
 
 #include "config.h"
+#include "lib/queue.h"
+#include "memory/page_allocator.h"
 #include "thread/lock.h"
 
+// Valid
+#define PAGE_V 0b1
 // Readable
 #define PAGE_R 0b10
 // Writeable
@@ -27,22 +31,62 @@ class MemoryRegion {
 	public:
 	MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, uint16_t flags, bool managed_alloc=true);
 	MemoryRegion(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint64_t physical_end, uint16_t flags, bool managed_alloc=false);
-	~MemoryRegion();
 
-	void allocate_pages();
+	// Shrinks this region to end at virtual_addr and returns a new region
+	// covering the rest.
+	MemoryRegion* split(uint64_t virtual_addr);
 
+	// Node in the page table's red-black tree, keyed by virtual_start.
 	MemoryRegion* left;
 	MemoryRegion* right;
 	MemoryRegion* parent;
+	bool red;
+	// Largest virtual_end in this subtree, so range queries can skip whole
+	// subtrees that end before the range starts.
+	uint64_t max_end;
 	uint64_t virtual_start;
 	uint64_t virtual_end;
 	uint64_t physical_start;
 	uint64_t physical_end;
 
 	// Indicates that we are automatically allocating pages (and thus responsible for freeing them).
+	// Managed regions are backed page by page as they fault, so the page
+	// table is the only record of their physical pages.
 	bool managed_alloc;
 
 	uint16_t flags;
+
+	// A 4K fault maps the whole aligned window of this many pages around it.
+	uint16_t fault_around_pages;
+
+	// Managed region whose pages may be shared with other page tables. Shared
+	// pages are mapped read-only and copied on the first write.
+	bool copy_on_write;
+
+	// Managed region whose pages compaction must never move, for memory the
+	// hart doing the compacting may be using, like its own stack.
+	bool pinned;
+};
+
+struct PageFaultStats {
+	uint64_t faults;
+	// Pages mapped ahead of time by fault-around, each one a fault saved if
+	// it's ever touched.
+	uint64_t faults_avoided;
+	// Writes to shared pages that needed a private copy.
+	uint64_t cow_copies;
+	// Leaves pointed at the shared zero page instead of a page of their own.
+	uint64_t zero_page_maps;
+};
+
+// Leaves cleared or downgraded while changing a table, gathered so the other
+// harts running it can be fenced once at the end instead of once per leaf.
+struct TlbShootdown {
+	uint64_t start = ~0ULL;
+	uint64_t end = 0;
+	uint64_t num_leaves = 0;
+	// ASID fences leave global leaves alone.
+	bool global = false;
 };
 
 class PageTable {
@@ -51,24 +95,108 @@ class PageTable {
 	~PageTable();
 
 	int map_pages(uint64_t virtual_start, uint64_t virtual_end, uint16_t flags);
-	// This variant assumes you've already allocated pages.
+	// This variant assumes you've already allocated pages. The range is mapped
+	// immediately, using 2M and 1G leaves wherever the alignment allows.
 	int map_pages(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint64_t physical_end, uint16_t flags);
 	int unmap_pages(uint64_t virtual_start, uint64_t virtual_end);
-	void handle_page_fault(uint64_t virtual_addr, uint16_t flags);
+	// Backs every unmapped page in the range up front instead of waiting for
+	// it to fault. The range must already be covered by memory regions.
+	int populate_pages(uint64_t virtual_start, uint64_t virtual_end);
+	// Safe to call from several harts at once. Faults only wait for each
+	// other if they race to fill the same entry, and for map_pages and
+	// unmap_pages calls.
+	int handle_page_fault(uint64_t virtual_addr, uint16_t flags);
+	// Maps the zeroed page at physical_addr to virtual_addr, which must lie in
+	// a managed region, without looking at the region tree or ever taking the
+	// lock. For faults from code that may be holding it. The page isn't made
+	// movable, so the region should be pinned. Returns 1 if something was
+	// mapped there already and the page wasn't used, and -1 if a table on the
+	// way couldn't be allocated.
+	int install_page(uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags);
+	// Moves the 4K page mapped at virtual_addr from old_physical to
+	// new_physical. Compaction calls this from an RCU read-side section the
+	// destructor waits on, so it gives up with -1 rather than wait if the
+	// table is busy.
+	int migrate_page(uint64_t virtual_addr, uint64_t old_physical, uint64_t new_physical);
+	// Maps the regions in the range into dest at the same addresses, replacing
+	// whatever dest had there. Managed pages are shared copy-on-write instead
+	// of copied, so only the page table entries are duplicated. dest must not
+	// be sharing into this table at the same time. On failure dest may hold
+	// part of the range and should be thrown away.
+	int share_pages(PageTable* dest, uint64_t virtual_start, uint64_t virtual_end);
+	// A copy-on-write duplicate of the whole address space.
+	PageTable* clone();
+	// Sets the fault-around window of the region containing virtual_addr.
+	// num_pages is rounded down to a power of two, and 1 turns it off.
+	int set_fault_around(uint64_t virtual_addr, uint64_t num_pages);
+	// Pins the region containing virtual_addr. Pages it maps from then on are
+	// left out of compaction.
+	int set_pinned(uint64_t virtual_addr);
+	void get_fault_stats(PageFaultStats& stats);
+	// Switches the calling hart to this table. Each table is tagged with its
+	// own ASID, so switching only flushes the entries of the table the hart
+	// leaves, which stops sending it shootdowns.
 	void use_page_table();
-	static void disable_paging();
 
 	private:
 	// Tree of non-overlapping memory regions representing the memory map of the process (or kernel).
+	// Kept balanced as a red-black tree so lookups stay O(log n).
 	MemoryRegion* root_memory_region;
-	uint64_t* root_page_table;
+	// Physical address of the root table.
+	uint64_t root_page_table;
+	// Only held for changes to the region tree and for clearing or rewriting
+	// entries. Faults run without it.
 	thread::Lock page_table_mutex;
+	// Set while a structural change is under way.
+	bool updating = false;
 	uint64_t cache_size = 0;
+	PageFaultStats fault_stats = {};
+	// ASIDs are handed out afresh after every rollover, so one is only valid
+	// while asid_generation is current.
+	uint64_t asid = 0;
+	uint64_t asid_generation = 0;
+	// Harts that have the table loaded (bit n is hart n), and the ASID each
+	// of them last loaded it with.
+	uint64_t active_harts = 0;
+	uint64_t hart_asids[MAX_HART] = {};
+	// Gathered by structural changes under the lock and sent by end_update.
+	// Pages they unmapped wait in pending_frees until the other harts have
+	// been fenced.
+	TlbShootdown pending_shootdown;
+	lib::Queue<PageBlock> pending_frees;
 
-	void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags);
+	void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint16_t flags, int level=0);
+	void map_range(uint64_t virtual_start, uint64_t virtual_end, uint64_t physical_start, uint16_t flags);
+	void begin_update();
+	void end_update();
+	int resolve_fault(uint64_t virtual_addr, uint16_t flags);
+	int map_fault(MemoryRegion* region, uint64_t virtual_addr, uint16_t flags, int empty_level);
+	bool install_leaf(uint64_t virtual_addr, uint64_t pte, int level);
+	void fault_around(MemoryRegion* region, uint64_t virtual_addr, uint64_t zero);
+	int share_region(MemoryRegion* region, PageTable* dest);
+	int break_cow(MemoryRegion* region, uint64_t virtual_addr, uint64_t* entry);
+	int unmap_range(uint64_t virtual_start, uint64_t virtual_end, bool free_pages);
 	uint64_t* get_page_table_entry(uint64_t virtual_addr);
-	void insert_memory_region_helper(MemoryRegion* node, MemoryRegion* to_insert);
+	uint64_t* get_page_table_entry(uint64_t virtual_addr, int& level);
+	uint64_t* get_or_create_page_table_entry(uint64_t virtual_addr, int level);
+	template <int curr_level>
+	uint64_t* create_entry(uint64_t* table, uint64_t virtual_addr, int level);
+	int split_superpage(uint64_t* entry, uint64_t virtual_addr, int level);
+	uint64_t local_asid();
+	void flush_leaf(uint64_t virtual_addr, uint64_t pte);
+	uint64_t remote_harts();
+	void send_shootdown(TlbShootdown& shootdown);
+	void flush_pending();
+	void free_page_table(uint64_t table_addr, int level);
+	void free_memory_regions(MemoryRegion* node);
+	void rotate_left(MemoryRegion* node);
+	void rotate_right(MemoryRegion* node);
+	void insert_fixup(MemoryRegion* node);
+	void remove_fixup(MemoryRegion* node, MemoryRegion* parent);
 	void insert_memory_region(MemoryRegion* to_insert);
+	void split_memory_regions(uint64_t virtual_start, uint64_t virtual_end);
+	int clear_memory_regions(uint64_t virtual_start, uint64_t virtual_end);
+	void replace_memory_region(MemoryRegion* node, MemoryRegion* replacement);
 	void remove_memory_region(MemoryRegion* node);
 	void find_contained_regions(uint64_t virtual_start, uint64_t virtual_end, lib::Queue<MemoryRegion*>& ret);
 	void find_contained_regions(MemoryRegion* node, uint64_t virtual_start, uint64_t virtual_end, lib::Queue<MemoryRegion*>& ret);
@@ -78,6 +206,15 @@ class PageTable {
 	MemoryRegion* find_memory_region(MemoryRegion* node, uint64_t virtual_start, uint64_t virtual_end);
 };
 
+// Picks the shallowest of Sv39, Sv48 and Sv57 the hart supports that can
+// identity map all of physical memory. Must be called with paging off, after
+// the page allocator is up and before the first PageTable is built.
+void initialize_paging();
+
+// Levels in every page table walk: 3 under Sv39, 4 under Sv48 and 5 under Sv57.
+// Level 0 holds 4K leaves, level 1 2M leaves, level 2 1G leaves and so on.
+int get_paging_levels();
+
 } // namespace memory
 
 #endif
@@ -2,17 +2,153 @@
 
 #include "config.h"
 #include "io/stdio.h"
+#include "lib/memory.h"
+#include "memory/page.h"
+#include "thread/hart.h"
 #include "thread/lock.h"
+#include "thread/rcu.h"
+
+extern "C" uint8_t kernel_end[];
 
 namespace memory {
 
 namespace {
 
+using lib::FdtNode;
+using lib::FdtProperty;
+
+// Largest block the buddy allocator tracks, 2^18 pages (1 GiB).
+#define MAX_ORDER (PAGE_ALLOCATOR_ORDERS - 1)
+
+#define MAX_MEMORY_RANGES 16
+#define MAX_RESERVED_RANGES 32
+
+#define NO_FRAME 0xFFFFFFFF
+
+// Set on the first frame of a block that currently sits on a free list.
+#define FRAME_FREE 0x01
+// Set on frames compaction has taken out of circulation while it empties the
+// block around them.
+#define FRAME_ISOLATED 0x02
+// Set on every frame of a block allocated with PAGE_BLOCK_SLAB.
+#define FRAME_SLAB 0x04
+// Set on pages sitting in a hart's page cache. They still count as allocated
+// to the buddy allocator, so this is what catches freeing one again.
+#define FRAME_CACHED 0x08
+
+// Capacity of each hart's page cache, and how many pages move between it and
+// the buddy allocator per lock acquisition.
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_BATCH 32
+
+// Capacity of the pool of pre-zeroed pages, and how many pages an idle hart
+// zeroes before checking for work again.
+#define ZERO_POOL_SIZE 256
+#define ZERO_POOL_BATCH 8
+// Pre-zeroed megapages kept per node for faults on large regions.
+#define ZERO_POOL_MEGAPAGES 2
+// Idle rounds a hart leaves the pool alone after the node ran out of pages
+// to fill it with.
+#define ZERO_POOL_DEFER_ROUNDS 1024
+
+// Idle harts compact until each node has a free block of this order (2M).
+// They only look every COMPACT_IDLE_ROUNDS idle rounds, and back off for
+// COMPACT_DEFER_ROUNDS when there's nothing they can do.
+#define COMPACT_IDLE_ORDER 9
+#define COMPACT_IDLE_ROUNDS 64
+#define COMPACT_DEFER_ROUNDS 1024
+// Frames scanned for a block to compact per hold of the allocator lock.
+#define COMPACT_SCAN_PAGES 4096
+
+struct PageFrame {
+	uint32_t next;
+	uint32_t prev;
+	uint8_t order;
+	uint8_t flags;
+	uint8_t node;
+
+	// Set for movable pages, the single leaf that maps the page. Compaction
+	// only follows it inside an RCU read-side section, and tables wait those
+	// out after clearing their pages' owners, so it never outlives its table.
+	PageTable* owner;
+	uint64_t virtual_addr;
+
+	// References held on top of the allocation itself, by copy-on-write
+	// mappings of the page.
+	uint32_t shares;
+};
+
+struct PhysicalRange {
+	uint64_t start;
+	uint64_t end;
+	uint32_t node;
+};
+
 thread::Lock page_alloc_mutex;
 
-uint64_t lowest_free_index = 0;
+// Frames are indexed relative to base_frame, the first frame of the lowest
+// memory node. Buddies are computed on absolute frame numbers so that a block
+// of order n is always naturally aligned to 2^n pages in physical memory.
+uint64_t base_frame = 0;
+uint64_t num_frames = 0;
+
+// Added to a physical address to reach it. Zero until the direct map is up.
+uint64_t direct_map_offset = 0;
+
+// Both live in free memory right after the kernel, sized to the memory the
+// device tree reports. Frames in holes between memory nodes stay allocated.
+uint8_t* allocation_bitmap = nullptr;
+PageFrame* page_frames = nullptr;
+
+// One doubly linked list of free blocks per node and order, threaded through
+// page_frames. Blocks never span nodes.
+uint32_t free_lists[MAX_NUMA_NODES][MAX_ORDER + 1];
+
+uint64_t num_numa_nodes = 1;
+NumaNodeStats numa_stats[MAX_NUMA_NODES];
+
+// Kept up to date as blocks move so a snapshot is just a copy. used_pages and
+// largest_free_block are filled in when the snapshot is taken.
+PageAllocatorStats allocator_stats;
+
+// Single pages owned by one hart. Only that hart ever touches its cache, so it
+// needs no lock. Pages in here are still marked allocated in the bitmap.
+struct __attribute__((aligned (64))) PageCache {
+	uint64_t num_pages;
+	uint64_t pages[PAGE_CACHE_SIZE];
+	PageCacheStats stats;
+	// Set by other harts that ran out of memory. The owner empties the cache
+	// the next time it allocates.
+	bool reclaim;
+};
+
+PageCache page_caches[MAX_HART];
+
+// Pre-zeroed pages, kept per node so the fault path gets local memory.
+struct ZeroPool {
+	thread::Lock mutex;
+	uint64_t num_pages;
+	uint64_t pages[ZERO_POOL_SIZE];
+	uint64_t num_megapages;
+	uint64_t megapages[ZERO_POOL_MEGAPAGES];
+	// Megapage being zeroed across several refills, and how much of it is
+	// done. filling_busy is set while a hart works on it outside the lock.
+	uint64_t filling;
+	uint64_t filled;
+	bool filling_busy;
+};
+
+ZeroPool zero_pools[MAX_NUMA_NODES];
+
+// Idle rounds each hart waits before its next look at fragmentation. Only
+// touched by the hart itself.
+uint64_t compact_defer[MAX_HART];
 
-uint8_t allocation_bitmap[(FREE_MEMORY_END - FREE_MEMORY_START) / PAGE_SIZE / 8];
+// Same for refilling the zero pool.
+uint64_t zero_pool_defer[MAX_HART];
+
+// Frame each node's next compaction scan starts from.
+uint64_t compact_cursors[MAX_NUMA_NODES];
 
 char check_allocation(uint64_t index) {
 	return (allocation_bitmap[index/8] >> (index % 8)) & 0x01;
@@ -23,72 +159,1148 @@ void set_allocation(uint64_t index) {
 }
 
 void clear_allocation(uint64_t index) {
-	allocation_bitmap[index/8] &= (0xFE << (index % 8));
+	allocation_bitmap[index/8] &= ~(0x01 << (index % 8));
 }
 
-} // namespace
+void push_free_block(uint64_t index, int order) {
+	PageFrame& frame = page_frames[index];
+	frame.order = order;
+	frame.flags |= FRAME_FREE;
+	allocator_stats.free_blocks[order]++;
+	frame.prev = NO_FRAME;
+	frame.next = free_lists[frame.node][order];
+	if (frame.next != NO_FRAME) {
+		page_frames[frame.next].prev = index;
+	}
+	free_lists[frame.node][order] = index;
+}
+
+void remove_free_block(uint64_t index) {
+	PageFrame& frame = page_frames[index];
+	if (frame.prev != NO_FRAME) {
+		page_frames[frame.prev].next = frame.next;
+	} else {
+		free_lists[frame.node][frame.order] = frame.next;
+	}
+	if (frame.next != NO_FRAME) {
+		page_frames[frame.next].prev = frame.prev;
+	}
+	frame.flags &= ~FRAME_FREE;
+	allocator_stats.free_blocks[frame.order]--;
+}
+
+// Returns a block of 2^order pages to the free lists, merging it with its
+// buddy for as long as the buddy is free, of the same order and on the same node.
+void free_block(uint64_t index, int order) {
+	while (order < MAX_ORDER) {
+		uint64_t buddy = ((base_frame + index) ^ (1ULL << order)) - base_frame;
+		if (buddy >= num_frames ||
+		    !(page_frames[buddy].flags & FRAME_FREE) ||
+		    page_frames[buddy].order != order ||
+		    page_frames[buddy].node != page_frames[index].node) {
+			break;
+		}
+		remove_free_block(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	push_free_block(index, order);
+}
+
+// Frees an arbitrary run of pages by splitting it into the largest naturally
+// aligned blocks it contains.
+void free_range(uint64_t index, uint64_t num_pages) {
+	while (num_pages) {
+		int order = 0;
+		while (order < MAX_ORDER &&
+		       !((base_frame + index) & ((2ULL << order) - 1)) &&
+		       (2ULL << order) <= num_pages) {
+			order++;
+		}
+		free_block(index, order);
+		index += 1ULL << order;
+		num_pages -= 1ULL << order;
+	}
+}
+
+int order_for_pages(uint64_t num_pages) {
+	int order = 0;
+	while ((1ULL << order) < num_pages) {
+		order++;
+	}
+	return order;
+}
+
+// Caller must hold page_alloc_mutex.
+int allocate_pages_locked(uint64_t num_pages, int node, uint64_t& index) {
+	int order = order_for_pages(num_pages);
+
+	int curr_order = order;
+	while (curr_order <= MAX_ORDER && free_lists[node][curr_order] == NO_FRAME) {
+		curr_order++;
+	}
+
+	if (curr_order > MAX_ORDER) {
+		return -1;
+	}
+
+	index = free_lists[node][curr_order];
+	remove_free_block(index);
+
+	// Split the block down to the requested order, handing the upper halves back.
+	while (curr_order > order) {
+		curr_order--;
+		push_free_block(index + (1ULL << curr_order), curr_order);
+	}
+
+	for (uint64_t i = index; i < index + num_pages; i++) {
+		set_allocation(i);
+	}
+
+	// Don't waste the tail of the block on requests that aren't a power of two.
+	free_range(index + num_pages, (1ULL << order) - num_pages);
+
+	numa_stats[node].free_pages -= num_pages;
+	allocator_stats.free_pages -= num_pages;
+	allocator_stats.allocations++;
+	uint64_t used_pages = allocator_stats.total_pages - allocator_stats.free_pages;
+	if (used_pages > allocator_stats.peak_used_pages) {
+		allocator_stats.peak_used_pages = used_pages;
+	}
+
+	return 0;
+}
+
+// Tries the preferred node first, then every other node. Caller must hold
+// page_alloc_mutex.
+int allocate_pages_any_node_locked(uint64_t num_pages, int node, uint64_t& index) {
+	if (!allocate_pages_locked(num_pages, node, index)) {
+		numa_stats[node].local_allocs++;
+		return 0;
+	}
+	for (uint64_t other_node = 0; other_node < num_numa_nodes; other_node++) {
+		if (other_node != node && !allocate_pages_locked(num_pages, other_node, index)) {
+			numa_stats[other_node].remote_allocs++;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Caller must hold page_alloc_mutex.
+int free_pages_locked(uint64_t start_index, uint64_t num_pages) {
+	for (uint64_t index = start_index; index < start_index + num_pages; index++) {
+		if (!check_allocation(index) || (page_frames[index].flags & FRAME_CACHED)) {
+			io::printk("free_page_block: Page %x is not allocated!\n", (index + base_frame) * PAGE_SIZE);
+			io::print_stack_trace();
+			return -1;
+		}
+	}
+	for (uint64_t index = start_index; index < start_index + num_pages; index++) {
+		clear_allocation(index);
+		page_frames[index].owner = nullptr;
+		page_frames[index].flags &= ~FRAME_SLAB;
+	}
+	free_range(start_index, num_pages);
+
+	numa_stats[page_frames[start_index].node].free_pages += num_pages;
+	allocator_stats.free_pages += num_pages;
+	allocator_stats.frees++;
+
+	return 0;
+}
+
+// Counts the movable pages in the block of 2^order pages at start. Returns
+// false if the block isn't all on node or holds a page that can't move.
+// Caller must hold page_alloc_mutex.
+bool count_movable(uint64_t start, int order, int node, uint64_t& num_movable) {
+	uint64_t block_size = 1ULL << order;
+	if (page_frames[start].node != node || page_frames[start + block_size - 1].node != node) {
+		return false;
+	}
+
+	num_movable = 0;
+	for (uint64_t index = start; index < start + block_size; index++) {
+		if (!check_allocation(index)) {
+			continue;
+		}
+		if (!__atomic_load_n(&page_frames[index].owner, __ATOMIC_RELAXED)) {
+			return false;
+		}
+		num_movable++;
+	}
+	return true;
+}
+
+uint64_t first_block(int order) {
+	uint64_t block_size = 1ULL << order;
+	return ((base_frame + block_size - 1) & ~(block_size - 1)) - base_frame;
+}
+
+uint64_t num_blocks(int order) {
+	uint64_t first = first_block(order);
+	return num_frames > first ? (num_frames - first) >> order : 0;
+}
+
+// Looks at up to COMPACT_SCAN_PAGES pages' worth of naturally aligned blocks
+// of 2^order pages, picking up where the node's last scan stopped, and keeps
+// the one that takes the fewest migrations to empty. Returns how many blocks
+// it looked at. Caller must hold page_alloc_mutex.
+uint64_t scan_compaction_blocks(int order, int node, bool& found, uint64_t& block_index, uint64_t& num_movable) {
+	uint64_t total = num_blocks(order);
+	if (!total) {
+		return 0;
+	}
+	uint64_t first = first_block(order);
+	uint64_t budget = COMPACT_SCAN_PAGES >> order;
+	if (!budget) {
+		budget = 1;
+	}
+	if (budget > total) {
+		budget = total;
+	}
+
+	uint64_t block = compact_cursors[node] >= first ? ((compact_cursors[node] - first) >> order) % total : 0;
+	for (uint64_t i = 0; i < budget; i++) {
+		uint64_t start = first + (block << order);
+		uint64_t movable;
+		if (count_movable(start, order, node, movable) && (!found || movable < num_movable)) {
+			block_index = start;
+			num_movable = movable;
+			found = true;
+		}
+		block = (block + 1) % total;
+	}
+	compact_cursors[node] = first + (block << order);
+
+	return budget;
+}
+
+// Pulls the free blocks inside [start, end) off the free lists so nothing
+// gets allocated into the block while it's being emptied. Caller must hold
+// page_alloc_mutex.
+void isolate_free_pages(uint64_t start, uint64_t end) {
+	uint64_t index = start;
+	while (index < end) {
+		PageFrame& frame = page_frames[index];
+		if (!(frame.flags & FRAME_FREE)) {
+			index++;
+			continue;
+		}
 
-int allocate_page_block(uint64_t target_size, PageBlock& block) {
+		uint64_t num_pages = 1ULL << frame.order;
+		remove_free_block(index);
+		for (uint64_t i = index; i < index + num_pages; i++) {
+			set_allocation(i);
+			page_frames[i].flags |= FRAME_ISOLATED;
+		}
+		numa_stats[frame.node].free_pages -= num_pages;
+		allocator_stats.free_pages -= num_pages;
+		index += num_pages;
+	}
+}
+
+// Hands every isolated frame in [start, end) back to the free lists. Caller
+// must hold page_alloc_mutex.
+void release_isolated_pages(uint64_t start, uint64_t end) {
+	for (uint64_t index = start; index < end; index++) {
+		if (page_frames[index].flags & FRAME_ISOLATED) {
+			page_frames[index].flags &= ~FRAME_ISOLATED;
+			free_pages_locked(index, 1);
+		}
+	}
+}
+
+// Moves the page in frame index somewhere outside [start, end). Caller must
+// hold page_alloc_mutex and be in an RCU read-side section. The lock is
+// dropped while the page is copied, so the frame may have been freed or
+// changed hands by the time it's taken back.
+int migrate_frame(uint64_t index, uint64_t start, uint64_t end) {
+	PageFrame& frame = page_frames[index];
+	uint64_t dest;
+	do {
+		if (allocate_pages_locked(1, frame.node, dest)) {
+			return -1;
+		}
+		// Pages freed into the block since it was isolated are fair game to
+		// keep, just not as a destination.
+		if (dest >= start && dest < end) {
+			page_frames[dest].flags |= FRAME_ISOLATED;
+		}
+	} while (dest >= start && dest < end);
+
+	// dest is owned before it's mapped, so if it's unmapped again as soon as
+	// the lock is dropped, freeing it clears the owner like any other page.
+	PageTable* owner = __atomic_load_n(&frame.owner, __ATOMIC_ACQUIRE);
+	uint64_t virtual_addr = frame.virtual_addr;
+	page_frames[dest].owner = owner;
+	page_frames[dest].virtual_addr = virtual_addr;
+
+	// The fences and the copy are the slow part, and nobody else needs the
+	// allocator lock for them.
+	page_alloc_mutex.unlock();
+	int ret = owner->migrate_page(virtual_addr,
+				      (index + base_frame) * PAGE_SIZE,
+				      (dest + base_frame) * PAGE_SIZE);
 	page_alloc_mutex.lock();
 
-	uint64_t actual_size = target_size;
-	if (actual_size % PAGE_SIZE) {
-		actual_size = ((actual_size / PAGE_SIZE) + 1) * PAGE_SIZE;
+	if (ret) {
+		// Still unmapped, whether the table was busy or the page had already
+		// moved on.
+		page_frames[dest].owner = nullptr;
+		free_pages_locked(dest, 1);
+		return 0;
 	}
 
-	uint64_t bitmap_size = actual_size / PAGE_SIZE;
+	// Nothing maps the old page anymore.
+	frame.owner = nullptr;
+	frame.flags |= FRAME_ISOLATED;
+	numa_stats[frame.node].migrated_pages++;
 
-	uint64_t current_streak = 0;
-	uint64_t index = lowest_free_index;
-	uint64_t current_streak_start = 0;
-	for (index; index < sizeof(allocation_bitmap) * 8; index++) {
+	return 0;
+}
+
+// Empties a block of 2^order pages on node by migrating the movable pages in
+// it. The lock is only held a chunk of frames at a time while looking for the
+// block, and dropped between pages while emptying it, so allocations elsewhere
+// aren't held up for the whole pass. Unless whole_node is set only one chunk
+// is scanned.
+int compact_block(int order, int node, bool whole_node) {
+	page_alloc_mutex.lock();
+
+	bool found = false;
+	uint64_t start;
+	uint64_t num_movable;
+	uint64_t total = num_blocks(order);
+	uint64_t scanned = 0;
+	while (true) {
+		uint64_t num_scanned = scan_compaction_blocks(order, node, found, start, num_movable);
+		scanned += num_scanned;
+		if (!whole_node || !num_scanned || scanned >= total) {
+			break;
+		}
+		page_alloc_mutex.unlock();
+		page_alloc_mutex.lock();
+	}
+	// The block may have taken an unmovable page since it was scanned.
+	if (!found || !count_movable(start, order, node, num_movable)) {
+		page_alloc_mutex.unlock();
+		return -1;
+	}
+	uint64_t end = start + (1ULL << order);
+	isolate_free_pages(start, end);
+
+	page_alloc_mutex.unlock();
+
+	bool out_of_pages = false;
+	for (uint64_t index = start; index < end && !out_of_pages; index++) {
+		thread::rcu_read_lock();
+		page_alloc_mutex.lock();
+		PageFrame& frame = page_frames[index];
+		if (check_allocation(index) && !(frame.flags & FRAME_ISOLATED) && __atomic_load_n(&frame.owner, __ATOMIC_ACQUIRE)) {
+			out_of_pages = migrate_frame(index, start, end);
+		}
+		page_alloc_mutex.unlock();
+		thread::rcu_read_unlock();
+	}
+
+	page_alloc_mutex.lock();
+
+	release_isolated_pages(start, end);
+	numa_stats[node].compactions++;
+
+	int ret = 0;
+	for (uint64_t index = start; index < end; index++) {
 		if (check_allocation(index)) {
-			current_streak = 0;
+			ret = -1;
+			break;
+		}
+	}
+
+	page_alloc_mutex.unlock();
+
+	return ret;
+}
+
+// Marks the range allocated or free. Free ranges are rounded inwards so a page
+// only partly backed by memory is never handed out, allocated ones outwards so
+// nothing touching a reserved byte is.
+void set_range(const PhysicalRange& range, bool allocated) {
+	uint64_t start;
+	uint64_t end;
+	if (allocated) {
+		start = range.start / PAGE_SIZE;
+		end = (range.end + PAGE_SIZE - 1) / PAGE_SIZE;
+	} else {
+		start = (range.start + PAGE_SIZE - 1) / PAGE_SIZE;
+		end = range.end / PAGE_SIZE;
+	}
+	if (start < base_frame) {
+		start = base_frame;
+	}
+	if (end > base_frame + num_frames) {
+		end = base_frame + num_frames;
+	}
+	for (uint64_t frame = start; frame < end; frame++) {
+		if (allocated) {
+			set_allocation(frame - base_frame);
 		} else {
-			if (!current_streak) {
-				current_streak_start = index;
+			clear_allocation(frame - base_frame);
+		}
+	}
+}
+
+int find_memory_ranges(const lib::Fdt& fdt, PhysicalRange* ranges) {
+	int num_ranges = 0;
+	FdtNode node;
+	bool found = fdt.get_root(node) && fdt.get_first_child(node, node);
+	while (found) {
+		FdtProperty device_type;
+		if (fdt.get_property(node, "device_type", device_type) &&
+		    device_type.equals("memory") &&
+		    fdt.is_enabled(node)) {
+			uint32_t numa_node = 0;
+			FdtProperty numa_node_id;
+			if (fdt.get_property(node, "numa-node-id", numa_node_id)) {
+				numa_node = numa_node_id.get_cell(0);
+			}
+			if (numa_node >= MAX_NUMA_NODES) {
+				io::printk("Treating memory on node %d as node 0, MAX_NUMA_NODES is %d\n", numa_node, MAX_NUMA_NODES);
+				numa_node = 0;
+			}
+
+			uint64_t address;
+			uint64_t size;
+			for (int i = 0; num_ranges < MAX_MEMORY_RANGES && fdt.get_reg(node, i, address, size); i++) {
+				ranges[num_ranges].start = address;
+				ranges[num_ranges].end = address + size;
+				ranges[num_ranges].node = numa_node;
+				num_ranges++;
 			}
-			current_streak++;
 		}
+		found = fdt.get_next_sibling(node, node);
+	}
 
-		if (current_streak == bitmap_size) {
-			break;
+	if (!num_ranges) {
+		io::printk("No memory nodes in device tree, assuming %x-%x\n", DEFAULT_MEMORY_START, DEFAULT_MEMORY_END);
+		ranges[0].start = DEFAULT_MEMORY_START;
+		ranges[0].end = DEFAULT_MEMORY_END;
+		ranges[0].node = 0;
+		num_ranges = 1;
+	}
+
+	return num_ranges;
+}
+
+int find_reserved_ranges(const lib::Fdt& fdt, PhysicalRange* ranges) {
+	// The kernel image and whatever firmware sits below it.
+	ranges[0].start = 0;
+	ranges[0].end = (uint64_t)kernel_end;
+	ranges[0].node = 0;
+	int num_ranges = 1;
+
+	if (fdt.is_valid()) {
+		ranges[num_ranges].start = fdt.get_start();
+		ranges[num_ranges].end = fdt.get_start() + fdt.get_size();
+		ranges[num_ranges].node = 0;
+		num_ranges++;
+	}
+
+	uint64_t address;
+	uint64_t size;
+	for (int i = 0; num_ranges < MAX_RESERVED_RANGES && fdt.get_memory_reservation(i, address, size); i++) {
+		ranges[num_ranges].start = address;
+		ranges[num_ranges].end = address + size;
+		ranges[num_ranges].node = 0;
+		num_ranges++;
+	}
+
+	FdtNode node;
+	bool found = fdt.find_node("/reserved-memory", node) && fdt.get_first_child(node, node);
+	while (found) {
+		for (int i = 0; num_ranges < MAX_RESERVED_RANGES && fdt.get_reg(node, i, address, size); i++) {
+			ranges[num_ranges].start = address;
+			ranges[num_ranges].end = address + size;
+			ranges[num_ranges].node = 0;
+			num_ranges++;
 		}
+		found = fdt.get_next_sibling(node, node);
 	}
 
-	if (index == sizeof(allocation_bitmap)*8) {
-		io::printk("allocate_page_block: Not enough contiguous pages!\n");
-		io::print_stack_trace();
+	return num_ranges;
+}
+
+// Returns the lowest page aligned address with size bytes of memory that
+// don't overlap anything reserved, or 0 if there's no such place.
+uint64_t find_metadata_space(PhysicalRange* memory_ranges,
+			     int num_memory_ranges,
+			     PhysicalRange* reserved_ranges,
+			     int num_reserved_ranges,
+			     uint64_t size) {
+	uint64_t best = 0;
+	for (int i = 0; i < num_memory_ranges; i++) {
+		uint64_t candidate = (memory_ranges[i].start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+		bool moved = true;
+		while (moved && candidate + size <= memory_ranges[i].end) {
+			moved = false;
+			for (int j = 0; j < num_reserved_ranges; j++) {
+				if (candidate < reserved_ranges[j].end && candidate + size > reserved_ranges[j].start) {
+					candidate = (reserved_ranges[j].end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+					moved = true;
+				}
+			}
+		}
+		if (!moved && candidate + size <= memory_ranges[i].end && (!best || candidate < best)) {
+			best = candidate;
+		}
+	}
+	return best;
+}
+
+PageCache* get_page_cache() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (!hart_state) {
+		return nullptr;
+	}
+	return &page_caches[hart_state->hart_id];
+}
+
+int get_local_node() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (!hart_state) {
+		return 0;
+	}
+	return thread::get_hart_node(hart_state->hart_id);
+}
+
+// Only takes pages from the hart's own node. If it's out, the cache stays
+// empty and allocations fall through to the any-node path.
+void refill_page_cache(PageCache* cache) {
+	int node = get_local_node();
+	page_alloc_mutex.lock();
+	uint64_t index;
+	while (cache->num_pages < PAGE_CACHE_BATCH && !allocate_pages_locked(1, node, index)) {
+		numa_stats[node].local_allocs++;
+		page_frames[index].flags |= FRAME_CACHED;
+		cache->pages[cache->num_pages] = index;
+		cache->num_pages++;
+	}
+	page_alloc_mutex.unlock();
+}
+
+// Frees pages from the cache until only keep are left.
+void drain_page_cache(PageCache* cache, uint64_t keep) {
+	page_alloc_mutex.lock();
+	while (cache->num_pages > keep) {
+		cache->num_pages--;
+		page_frames[cache->pages[cache->num_pages]].flags &= ~FRAME_CACHED;
+		free_pages_locked(cache->pages[cache->num_pages], 1);
+	}
+	page_alloc_mutex.unlock();
+	cache->stats.drains++;
+}
+
+// Hands the pages parked in this hart's cache and in the zero pools back to
+// the free lists. Other harts' caches are only theirs to touch, so they're
+// just asked to empty themselves.
+void reclaim_pages() {
+	PageCache* cache = get_page_cache();
+	if (cache) {
+		drain_page_cache(cache, 0);
+	}
+	for (int hart = 0; hart < MAX_HART; hart++) {
+		if (&page_caches[hart] != cache) {
+			__atomic_store_n(&page_caches[hart].reclaim, true, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (int node = 0; node < MAX_NUMA_NODES; node++) {
+		ZeroPool& pool = zero_pools[node];
+		pool.mutex.lock();
+		page_alloc_mutex.lock();
+		while (pool.num_pages) {
+			pool.num_pages--;
+			free_pages_locked(pool.pages[pool.num_pages] / PAGE_SIZE - base_frame, 1);
+		}
+		while (pool.num_megapages) {
+			pool.num_megapages--;
+			free_pages_locked(pool.megapages[pool.num_megapages] / PAGE_SIZE - base_frame, MEGAPAGE_SIZE / PAGE_SIZE);
+		}
+		// A half zeroed megapage can go too, unless a hart is zeroing it
+		// right now.
+		if (pool.filling && !pool.filling_busy) {
+			free_pages_locked(pool.filling / PAGE_SIZE - base_frame, MEGAPAGE_SIZE / PAGE_SIZE);
+			pool.filling = 0;
+		}
+		page_alloc_mutex.unlock();
+		pool.mutex.unlock();
+	}
+}
+
+// Serves single pages from the hart's cache where possible.
+int allocate_pages(uint64_t num_pages, PageBlock& block, uint64_t flags, int node) {
+	int local_node = get_local_node();
+	if (node == NUMA_NODE_LOCAL) {
+		node = local_node;
+	}
+
+	// The cache only holds pages from the hart's own node.
+	PageCache* cache = nullptr;
+	if (num_pages == 1 && node == local_node) {
+		cache = get_page_cache();
+	}
+	if (cache) {
+		if (__atomic_load_n(&cache->reclaim, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&cache->reclaim, false, __ATOMIC_RELAXED);
+			drain_page_cache(cache, 0);
+		}
+		if (cache->num_pages) {
+			cache->stats.hits++;
+		} else {
+			cache->stats.misses++;
+			refill_page_cache(cache);
+		}
+		if (cache->num_pages) {
+			cache->num_pages--;
+			page_frames[cache->pages[cache->num_pages]].flags &= ~FRAME_CACHED;
+			block.start = (cache->pages[cache->num_pages] + base_frame) * PAGE_SIZE;
+			block.size = PAGE_SIZE;
+			return 0;
+		}
+	}
+
+	page_alloc_mutex.lock();
+
+	uint64_t index;
+	int ret = allocate_pages_any_node_locked(num_pages, node, index);
+	page_alloc_mutex.unlock();
+
+	// There may be enough free pages, just not in one piece. Callers with a
+	// fallback would rather take it than wait on migrations.
+	if (ret && num_pages > 1 && !(flags & PAGE_BLOCK_TRY) && !compact_block(order_for_pages(num_pages), node, true)) {
+		page_alloc_mutex.lock();
+		ret = allocate_pages_any_node_locked(num_pages, node, index);
+		page_alloc_mutex.unlock();
+	}
+
+	// Last resort before failing, the pages parked in caches and pools. Not
+	// for callers that are filling those in the first place.
+	if (ret && !(flags & PAGE_BLOCK_TRY)) {
+		reclaim_pages();
+		page_alloc_mutex.lock();
+		ret = allocate_pages_any_node_locked(num_pages, node, index);
+		page_alloc_mutex.unlock();
+	}
+
+	if (ret) {
+		page_alloc_mutex.lock();
+		allocator_stats.failures++;
+		page_alloc_mutex.unlock();
+		if (!(flags & PAGE_BLOCK_TRY)) {
+			io::printk("allocate_page_block: Not enough contiguous pages!\n");
+			io::print_stack_trace();
+		}
 		return -1;
 	}
 
-	for (index = current_streak_start; index < current_streak_start + bitmap_size; index++) {
-		set_allocation(index);
+	block.start = (index + base_frame) * PAGE_SIZE;
+	block.size = num_pages * PAGE_SIZE;
+
+	return 0;
+}
+
+bool take_zeroed_page(PageBlock& block, int node) {
+	if (node == NUMA_NODE_LOCAL) {
+		node = get_local_node();
+	}
+	ZeroPool& pool = zero_pools[node];
+	pool.mutex.lock();
+	if (!pool.num_pages) {
+		pool.mutex.unlock();
+		return false;
+	}
+	pool.num_pages--;
+	block.start = pool.pages[pool.num_pages];
+	block.size = PAGE_SIZE;
+	pool.mutex.unlock();
+	return true;
+}
+
+bool take_zeroed_megapage(PageBlock& block, int node) {
+	if (node == NUMA_NODE_LOCAL) {
+		node = get_local_node();
+	}
+	ZeroPool& pool = zero_pools[node];
+	pool.mutex.lock();
+	if (!pool.num_megapages) {
+		pool.mutex.unlock();
+		return false;
+	}
+	pool.num_megapages--;
+	block.start = pool.megapages[pool.num_megapages];
+	block.size = MEGAPAGE_SIZE;
+	pool.mutex.unlock();
+	return true;
+}
+
+// Zeroes the next ZERO_POOL_BATCH pages' worth of the megapage being filled,
+// so an idle hart never spends long away from its work queue. Returns -1 if
+// the node had no megapage to fill.
+int refill_zero_megapages(int node) {
+	ZeroPool& pool = zero_pools[node];
+	// Peek first, idle harts call this over and over once the pool is full.
+	if (__atomic_load_n(&pool.num_megapages, __ATOMIC_RELAXED) == ZERO_POOL_MEGAPAGES ||
+	    __atomic_load_n(&pool.filling_busy, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	pool.mutex.lock();
+	if (pool.num_megapages == ZERO_POOL_MEGAPAGES || pool.filling_busy) {
+		pool.mutex.unlock();
+		return 0;
+	}
+	pool.filling_busy = true;
+	uint64_t megapage = pool.filling;
+	uint64_t filled = pool.filled;
+	pool.mutex.unlock();
+
+	if (!megapage) {
+		// Same as single pages, only megapages from the node itself.
+		PageBlock block;
+		bool allocated = !allocate_pages(MEGAPAGE_SIZE / PAGE_SIZE, block, PAGE_BLOCK_TRY, node);
+		if (allocated && page_frames[block.start / PAGE_SIZE - base_frame].node != node) {
+			free_page_block(block);
+			allocated = false;
+		}
+		if (!allocated) {
+			pool.mutex.lock();
+			pool.filling_busy = false;
+			pool.mutex.unlock();
+			return -1;
+		}
+		megapage = block.start;
+		filled = 0;
+	}
+
+	uint64_t end = filled + ZERO_POOL_BATCH * PAGE_SIZE;
+	lib::bzero((uint8_t*)phys_to_virt(megapage) + filled, end - filled);
+
+	pool.mutex.lock();
+	if (end == MEGAPAGE_SIZE) {
+		pool.megapages[pool.num_megapages] = megapage;
+		pool.num_megapages++;
+		pool.filling = 0;
+	} else {
+		pool.filling = megapage;
+		pool.filled = end;
+	}
+	pool.filling_busy = false;
+	pool.mutex.unlock();
+
+	return 0;
+}
+
+} // namespace
+
+void initialize_page_allocator(const lib::Fdt& fdt) {
+	PhysicalRange memory_ranges[MAX_MEMORY_RANGES];
+	PhysicalRange reserved_ranges[MAX_RESERVED_RANGES];
+	int num_memory_ranges = find_memory_ranges(fdt, memory_ranges);
+	int num_reserved_ranges = find_reserved_ranges(fdt, reserved_ranges);
 
-		if (current_streak_start == lowest_free_index) {
-			lowest_free_index = current_streak_start + bitmap_size;
+	uint64_t memory_start = memory_ranges[0].start;
+	uint64_t memory_end = memory_ranges[0].end;
+	for (int i = 1; i < num_memory_ranges; i++) {
+		if (memory_ranges[i].start < memory_start) {
+			memory_start = memory_ranges[i].start;
+		}
+		if (memory_ranges[i].end > memory_end) {
+			memory_end = memory_ranges[i].end;
+		}
+	}
+	base_frame = memory_start / PAGE_SIZE;
+	num_frames = memory_end / PAGE_SIZE - base_frame;
+	num_numa_nodes = 1;
+	for (int i = 0; i < num_memory_ranges; i++) {
+		if (memory_ranges[i].node >= num_numa_nodes) {
+			num_numa_nodes = memory_ranges[i].node + 1;
 		}
 	}
 
-	block.start = current_streak_start * PAGE_SIZE + FREE_MEMORY_START;
-	block.size = actual_size;
+	uint64_t bitmap_size = (num_frames + 7) / 8;
+	uint64_t metadata_size = num_frames * sizeof(PageFrame) + bitmap_size;
+	uint64_t metadata_start = find_metadata_space(memory_ranges,
+						      num_memory_ranges,
+						      reserved_ranges,
+						      num_reserved_ranges,
+						      metadata_size);
+	if (!metadata_start) {
+		io::printk("initialize_page_allocator: No room for %d bytes of page metadata!\n", metadata_size);
+		io::print_stack_trace();
+		return;
+	}
+
+	page_alloc_mutex.lock();
+
+	page_frames = (PageFrame*)metadata_start;
+	allocation_bitmap = (uint8_t*)(metadata_start + num_frames * sizeof(PageFrame));
+	lib::bzero((uint8_t*)page_frames, num_frames * sizeof(PageFrame));
+	lib::memset(allocation_bitmap, 0xFF, bitmap_size);
+	for (int node = 0; node < MAX_NUMA_NODES; node++) {
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			free_lists[node][order] = NO_FRAME;
+		}
+	}
+
+	// Start with everything allocated, open up the memory nodes, then take
+	// the reserved ranges and our own metadata back out.
+	for (int i = 0; i < num_memory_ranges; i++) {
+		set_range(memory_ranges[i], false);
+		uint64_t start = (memory_ranges[i].start + PAGE_SIZE - 1) / PAGE_SIZE - base_frame;
+		uint64_t end = memory_ranges[i].end / PAGE_SIZE - base_frame;
+		if (end < start) {
+			end = start;
+		}
+		for (uint64_t index = start; index < end; index++) {
+			page_frames[index].node = memory_ranges[i].node;
+		}
+		numa_stats[memory_ranges[i].node].total_pages += end - start;
+		allocator_stats.total_pages += end - start;
+	}
+	for (int i = 0; i < num_reserved_ranges; i++) {
+		set_range(reserved_ranges[i], true);
+	}
+	PhysicalRange metadata_range = {metadata_start, metadata_start + metadata_size};
+	set_range(metadata_range, true);
+
+	uint64_t free_pages = 0;
+	uint64_t index = 0;
+	while (index < num_frames) {
+		if (check_allocation(index)) {
+			index++;
+			continue;
+		}
+		// Runs stop at node boundaries so no block ends up spanning two nodes.
+		uint64_t run_start = index;
+		while (index < num_frames &&
+		       !check_allocation(index) &&
+		       page_frames[index].node == page_frames[run_start].node) {
+			index++;
+		}
+		free_range(run_start, index - run_start);
+		numa_stats[page_frames[run_start].node].free_pages += index - run_start;
+		allocator_stats.free_pages += index - run_start;
+		free_pages += index - run_start;
+	}
 
 	page_alloc_mutex.unlock();
 
+	io::printk("Page allocator: %d ranges on %d nodes, %d of %d pages free\n",
+		   num_memory_ranges,
+		   num_numa_nodes,
+		   free_pages,
+		   num_frames);
+}
+
+uint64_t get_memory_start() {
+	return base_frame * PAGE_SIZE;
+}
+
+uint64_t get_memory_end() {
+	return (base_frame + num_frames) * PAGE_SIZE;
+}
+
+void* phys_to_virt(uint64_t physical_addr) {
+	return (void*)(physical_addr + direct_map_offset);
+}
+
+void enable_direct_map() {
+	__atomic_store_n(&direct_map_offset, DIRECT_MAP_START, __ATOMIC_RELEASE);
+}
+
+int allocate_page_block(uint64_t target_size, PageBlock& block, uint64_t flags, int node) {
+	uint64_t num_pages = (target_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (!num_pages) {
+		num_pages = 1;
+	}
+	if (flags & PAGE_BLOCK_HUGE) {
+		// Blocks of at least 2^n pages always start on a 2^n page boundary, so
+		// rounding the size is enough to get the alignment.
+		uint64_t pages_per_megapage = MEGAPAGE_SIZE / PAGE_SIZE;
+		num_pages = (num_pages + pages_per_megapage - 1) / pages_per_megapage * pages_per_megapage;
+	}
+
+	if ((flags & PAGE_BLOCK_ZERO) && num_pages == 1 && take_zeroed_page(block, node)) {
+		return 0;
+	}
+	if ((flags & PAGE_BLOCK_ZERO) && num_pages == MEGAPAGE_SIZE / PAGE_SIZE && take_zeroed_megapage(block, node)) {
+		return 0;
+	}
+	if ((flags & PAGE_BLOCK_ZERO) && (flags & PAGE_BLOCK_POOLED)) {
+		return -1;
+	}
+
+	if (allocate_pages(num_pages, block, flags, node)) {
+		return -1;
+	}
+
+	if (flags & PAGE_BLOCK_ZERO) {
+		lib::bzero((uint8_t*)phys_to_virt(block.start), block.size);
+	}
+
+	if (flags & PAGE_BLOCK_SLAB) {
+		uint64_t start_index = block.start / PAGE_SIZE - base_frame;
+		for (uint64_t index = start_index; index < start_index + num_pages; index++) {
+			page_frames[index].flags |= FRAME_SLAB;
+		}
+	}
+
 	return 0;
 }
 
 void free_page_block(PageBlock& block) {
+	if (block.start < base_frame * PAGE_SIZE ||
+	    block.start + block.size > (base_frame + num_frames) * PAGE_SIZE ||
+	    block.start % PAGE_SIZE) {
+		io::printk("free_page_block: Invalid page block %x-%x!\n", block.start, block.start + block.size);
+		io::print_stack_trace();
+		return;
+	}
+
+	uint64_t start_index = block.start / PAGE_SIZE - base_frame;
+	uint64_t num_pages = (block.size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	// Remote pages go straight back to their own node rather than into this
+	// hart's cache, where they'd be handed out as if they were local.
+	PageCache* cache = nullptr;
+	if (num_pages == 1 && page_frames[start_index].node == get_local_node()) {
+		cache = get_page_cache();
+	}
+	if (cache) {
+		// Same check free_pages_locked does, so a double free can't put the
+		// page in the cache twice and have it handed out twice.
+		if (!check_allocation(start_index) || (page_frames[start_index].flags & FRAME_CACHED)) {
+			io::printk("free_page_block: Page %x is not allocated!\n", block.start);
+			io::print_stack_trace();
+			return;
+		}
+		// Compaction may have read the old owner already. The table waits
+		// for it before going away.
+		__atomic_store_n(&page_frames[start_index].owner, nullptr, __ATOMIC_RELEASE);
+		page_frames[start_index].flags &= ~FRAME_SLAB;
+		page_frames[start_index].flags |= FRAME_CACHED;
+		if (cache->num_pages == PAGE_CACHE_SIZE) {
+			drain_page_cache(cache, PAGE_CACHE_SIZE - PAGE_CACHE_BATCH);
+		}
+		cache->pages[cache->num_pages] = start_index;
+		cache->num_pages++;
+		cache->stats.frees++;
+		return;
+	}
+
 	page_alloc_mutex.lock();
+	free_pages_locked(start_index, num_pages);
+	page_alloc_mutex.unlock();
+}
+
+void refill_zero_pool() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	uint64_t hart_id = hart_state ? hart_state->hart_id : 0;
+	if (zero_pool_defer[hart_id]) {
+		zero_pool_defer[hart_id]--;
+		return;
+	}
 
-	if (lowest_free_index < (block.start - FREE_MEMORY_START) / PAGE_SIZE) {
-		lowest_free_index = (block.start - FREE_MEMORY_START) / PAGE_SIZE;
+	int node = get_local_node();
+	ZeroPool& pool = zero_pools[node];
+	// The count is only peeked at here, the lock is taken once there's a page
+	// to add.
+	for (int i = 0; i < ZERO_POOL_BATCH && __atomic_load_n(&pool.num_pages, __ATOMIC_RELAXED) < ZERO_POOL_SIZE; i++) {
+		PageBlock page;
+		if (allocate_pages(1, page, PAGE_BLOCK_TRY, node)) {
+			zero_pool_defer[hart_id] = ZERO_POOL_DEFER_ROUNDS;
+			return;
+		}
+
+		// Don't fill the pool with pages the node had to borrow from elsewhere.
+		if (page_frames[page.start / PAGE_SIZE - base_frame].node != node) {
+			free_page_block(page);
+			zero_pool_defer[hart_id] = ZERO_POOL_DEFER_ROUNDS;
+			return;
+		}
+
+		// Zero outside the lock, the page isn't visible to anyone else yet.
+		lib::bzero((uint8_t*)phys_to_virt(page.start), PAGE_SIZE);
+
+		pool.mutex.lock();
+		bool pooled = pool.num_pages < ZERO_POOL_SIZE;
+		if (pooled) {
+			pool.pages[pool.num_pages] = page.start;
+			pool.num_pages++;
+		}
+		pool.mutex.unlock();
+
+		if (!pooled) {
+			free_page_block(page);
+			return;
+		}
 	}
-	for (uint64_t index = (block.start - FREE_MEMORY_START) / PAGE_SIZE; index < block.size / PAGE_SIZE; index++) {
-		clear_allocation(index);	
+
+	if (__atomic_load_n(&pool.num_pages, __ATOMIC_RELAXED) == ZERO_POOL_SIZE && refill_zero_megapages(node)) {
+		zero_pool_defer[hart_id] = ZERO_POOL_DEFER_ROUNDS;
 	}
+}
 
+void get_page_allocator_stats(PageAllocatorStats& stats) {
+	page_alloc_mutex.lock();
+	stats = allocator_stats;
 	page_alloc_mutex.unlock();
+
+	stats.used_pages = stats.total_pages - stats.free_pages;
+	stats.largest_free_block = 0;
+	for (int order = MAX_ORDER; order >= 0; order--) {
+		if (stats.free_blocks[order]) {
+			stats.largest_free_block = 1ULL << order;
+			break;
+		}
+	}
+}
+
+void print_page_allocator_stats() {
+	PageAllocatorStats stats;
+	get_page_allocator_stats(stats);
+	io::printk("Pages: %d used, %d free, %d total, %d peak used, largest free block %d\n",
+		   stats.used_pages,
+		   stats.free_pages,
+		   stats.total_pages,
+		   stats.peak_used_pages,
+		   stats.largest_free_block);
+	io::printk("Pages: %d allocations, %d frees, %d failures\n", stats.allocations, stats.frees, stats.failures);
+	for (int order = 0; order <= MAX_ORDER; order++) {
+		if (stats.free_blocks[order]) {
+			io::printk("  %d free blocks of %d pages\n", stats.free_blocks[order], 1ULL << order);
+		}
+	}
+}
+
+void get_page_cache_stats(uint64_t hart_id, PageCacheStats& stats) {
+	stats = page_caches[hart_id].stats;
+}
+
+void print_page_cache_stats() {
+	for (uint64_t i = 0; i < thread::get_num_harts(); i++) {
+		uint64_t hart_id = thread::get_hart_id(i);
+		PageCacheStats& stats = page_caches[hart_id].stats;
+		uint64_t allocs = stats.hits + stats.misses;
+		io::printk("Hart %d page cache: %d/%d hits (%d%%), %d frees, %d drains\n",
+			   hart_id,
+			   stats.hits,
+			   allocs,
+			   allocs ? stats.hits * 100 / allocs : 0,
+			   stats.frees,
+			   stats.drains);
+	}
+}
+
+bool is_slab_page(uint64_t physical_addr) {
+	if (physical_addr < base_frame * PAGE_SIZE || physical_addr >= (base_frame + num_frames) * PAGE_SIZE) {
+		return false;
+	}
+	return page_frames[physical_addr / PAGE_SIZE - base_frame].flags & FRAME_SLAB;
+}
+
+void set_page_owner(uint64_t physical_addr, PageTable* owner, uint64_t virtual_addr) {
+	uint64_t index = physical_addr / PAGE_SIZE - base_frame;
+	page_alloc_mutex.lock();
+	page_frames[index].owner = owner;
+	page_frames[index].virtual_addr = virtual_addr;
+	page_alloc_mutex.unlock();
+}
+
+void share_page(uint64_t physical_addr) {
+	uint64_t index = physical_addr / PAGE_SIZE - base_frame;
+	page_alloc_mutex.lock();
+	page_frames[index].owner = nullptr;
+	page_frames[index].shares++;
+	page_alloc_mutex.unlock();
+}
+
+bool release_page(uint64_t physical_addr) {
+	uint64_t index = physical_addr / PAGE_SIZE - base_frame;
+	page_alloc_mutex.lock();
+	if (page_frames[index].shares) {
+		page_frames[index].shares--;
+		page_alloc_mutex.unlock();
+		return false;
+	}
+	page_alloc_mutex.unlock();
+
+	PageBlock block;
+	block.start = physical_addr;
+	block.size = PAGE_SIZE;
+	free_page_block(block);
+	return true;
+}
+
+bool is_page_shared(uint64_t physical_addr) {
+	return page_frames[physical_addr / PAGE_SIZE - base_frame].shares;
+}
+
+int compact_pages(uint64_t num_pages, int node) {
+	if (node == NUMA_NODE_LOCAL) {
+		node = get_local_node();
+	}
+	return compact_block(order_for_pages(num_pages), node, true);
+}
+
+void compact_memory() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	uint64_t hart_id = hart_state ? hart_state->hart_id : 0;
+	if (compact_defer[hart_id]) {
+		compact_defer[hart_id]--;
+		return;
+	}
+	compact_defer[hart_id] = COMPACT_IDLE_ROUNDS;
+
+	// Peek without the lock. A stale answer only costs a wasted or late pass,
+	// and idle harts stay off the lock while memory isn't fragmented.
+	int node = get_local_node();
+	bool fragmented = __atomic_load_n(&numa_stats[node].free_pages, __ATOMIC_RELAXED) >= (1ULL << COMPACT_IDLE_ORDER);
+	for (int order = COMPACT_IDLE_ORDER; fragmented && order <= MAX_ORDER; order++) {
+		if (__atomic_load_n(&free_lists[node][order], __ATOMIC_RELAXED) != NO_FRAME) {
+			fragmented = false;
+		}
+	}
+
+	if (fragmented && compact_block(COMPACT_IDLE_ORDER, node, false)) {
+		compact_defer[hart_id] = COMPACT_DEFER_ROUNDS;
+	}
+}
+
+uint64_t get_num_numa_nodes() {
+	return num_numa_nodes;
+}
+
+void get_numa_node_stats(int node, NumaNodeStats& stats) {
+	page_alloc_mutex.lock();
+	stats = numa_stats[node];
+	page_alloc_mutex.unlock();
+}
+
+void print_numa_stats() {
+	for (uint64_t node = 0; node < num_numa_nodes; node++) {
+		NumaNodeStats stats;
+		get_numa_node_stats(node, stats);
+		io::printk("Node %d: %d of %d pages free, %d local allocations, %d remote allocations, %d pages migrated in %d compactions\n",
+			   node,
+			   stats.free_pages,
+			   stats.total_pages,
+			   stats.local_allocs,
+			   stats.remote_allocs,
+			   stats.migrated_pages,
+			   stats.compactions);
+	}
 }
 
 } // namespace memory
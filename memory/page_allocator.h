@@ -3,17 +3,153 @@
 
 #include <stdint.h>
 
+#include "lib/fdt.h"
+
+// Round the request up to whole 2M superpages. The block is naturally aligned
+// to 2M so it can be mapped with megapage leaf entries.
+#define PAGE_BLOCK_HUGE 0x01
+// The block comes back zeroed. Single pages and megapages are taken from pools
+// that idle harts keep topped up, so this is usually free.
+#define PAGE_BLOCK_ZERO 0x02
+// Fail quietly, the caller has a fallback.
+#define PAGE_BLOCK_TRY 0x04
+// The block holds slab objects. Lets kfree tell slab memory apart from the
+// heap with is_slab_page.
+#define PAGE_BLOCK_SLAB 0x08
+// With PAGE_BLOCK_ZERO, fail rather than zero the block on the spot if the
+// pools have nothing to hand out. Implies PAGE_BLOCK_TRY.
+#define PAGE_BLOCK_POOLED 0x10
+
+// Number of block sizes the buddy allocator tracks, 2^0 to 2^18 pages.
+#define PAGE_ALLOCATOR_ORDERS 19
+
+// Allocate from the calling hart's NUMA node.
+#define NUMA_NODE_LOCAL -1
+
 namespace memory {
 
+class PageTable;
+
 struct PageBlock {
 	uint64_t start;
 	uint64_t size;
 };
 
-int allocate_page_block(uint64_t target_size, PageBlock& block);
+// Snapshot of the whole allocator. Allocations, frees and failures count
+// blocks going in and out of the buddy allocator. Single pages recycled
+// through the per-hart caches show up in PageCacheStats instead, and count as
+// used here.
+struct PageAllocatorStats {
+	uint64_t total_pages;
+	uint64_t free_pages;
+	uint64_t used_pages;
+	uint64_t peak_used_pages;
+	// Pages in the largest free naturally aligned block.
+	uint64_t largest_free_block;
+	// Number of free blocks of 2^order pages, indexed by order.
+	uint64_t free_blocks[PAGE_ALLOCATOR_ORDERS];
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t failures;
+};
+
+// Counters for a hart's cache of single pages. Hits are served without
+// taking the global page allocator lock.
+struct PageCacheStats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t frees;
+	uint64_t drains;
+};
+
+// Page counts for one NUMA node. Allocations are counted as they leave the
+// buddy allocator, so pages recycled through the per-hart caches don't show
+// up here.
+struct NumaNodeStats {
+	uint64_t total_pages;
+	uint64_t free_pages;
+	// Allocations that landed on the node they asked for.
+	uint64_t local_allocs;
+	// Allocations this node took because the node they asked for was full.
+	uint64_t remote_allocs;
+	uint64_t compactions;
+	uint64_t migrated_pages;
+};
+
+// Must be called once before any page blocks are allocated. Sizes the
+// allocator to the memory nodes in the device tree, leaving the kernel image,
+// the device tree itself and any reserved memory alone.
+void initialize_page_allocator(const lib::Fdt& fdt);
+
+// Start of the lowest physical memory range the allocator manages.
+uint64_t get_memory_start();
+
+// End of the highest physical memory range the allocator manages.
+uint64_t get_memory_end();
+
+// Where physical_addr can be reached through the direct map. Before the
+// direct map is enabled this is just physical_addr, which only works with
+// paging off or under the identity map.
+void* phys_to_virt(uint64_t physical_addr);
+
+// Switches phys_to_virt over to the direct map. Every hart must be running
+// on a page table that has it from then on.
+void enable_direct_map();
+
+// Blocks come from the requested node if it has room, otherwise from whichever
+// node does.
+int allocate_page_block(uint64_t target_size, PageBlock& block, uint64_t flags=0, int node=NUMA_NODE_LOCAL);
 
 void free_page_block(PageBlock& block);
 
+bool is_slab_page(uint64_t physical_addr);
+
+// Marks a single page as movable. Its only reference must be the leaf mapping
+// virtual_addr in owner, which compaction rewrites if it moves the page. The
+// mark is dropped when the page is freed.
+void set_page_owner(uint64_t physical_addr, PageTable* owner, uint64_t virtual_addr);
+
+// Takes another reference to a single page so more than one leaf can map it.
+// Shared pages lose their owner, so compaction leaves them where they are.
+void share_page(uint64_t physical_addr);
+
+// Drops a reference to a single page and frees it with the last one. Returns
+// true if the page was freed.
+bool release_page(uint64_t physical_addr);
+
+bool is_page_shared(uint64_t physical_addr);
+
+// Migrates movable pages out of the way until there's a free block big enough
+// for num_pages on node. Returns -1 if no block could be emptied. Failed
+// contiguous allocations without PAGE_BLOCK_TRY already do this themselves.
+int compact_pages(uint64_t num_pages, int node=NUMA_NODE_LOCAL);
+
+// Compacts the calling hart's node a block at a time while it has no free
+// megapage-sized block left, backing off when that isn't possible. Meant for
+// idle harts.
+void compact_memory();
+
+// Zeroes a few free pages into the pools PAGE_BLOCK_ZERO allocations are served
+// from, a chunk of a megapage at a time once the single pages are topped up.
+// Meant to be called from harts that have nothing better to do. Backs off for
+// a while when the node has nothing to fill them with.
+void refill_zero_pool();
+
+// Only copies counters under the lock, so it's cheap enough to poll.
+void get_page_allocator_stats(PageAllocatorStats& stats);
+
+void print_page_allocator_stats();
+
+void get_page_cache_stats(uint64_t hart_id, PageCacheStats& stats);
+
+void print_page_cache_stats();
+
+uint64_t get_num_numa_nodes();
+
+void get_numa_node_stats(int node, NumaNodeStats& stats);
+
+void print_numa_stats();
+
 } // namespace memory
 
 #endif
@@ -0,0 +1,308 @@
+#include "memory/slab.h"
+
+#include "config.h"
+#include "io/stdio.h"
+#include "memory/page_allocator.h"
+#include "thread/hart.h"
+#include "thread/lock.h"
+
+namespace memory {
+
+namespace {
+
+using io::printk;
+
+// Slabs are naturally aligned blocks of this size, so an object's slab header
+// is found by masking its address.
+#define SLAB_SIZE (4 * PAGE_SIZE)
+
+// Objects are aligned to their size, up to a cache line.
+#define SLAB_MAX_ALIGN 64
+
+struct FreeObject {
+	FreeObject* next;
+};
+
+struct SlabArena;
+
+// Lives at the start of each slab, followed by the objects.
+struct Slab {
+	Slab* next;
+	Slab* prev;
+	FreeObject* free_list;
+	uint64_t in_use;
+	uint64_t capacity;
+	SlabArena* arena;
+	int index;
+};
+
+struct SlabClass {
+	// Slabs with at least one free object. Full slabs aren't tracked until an
+	// object in them is freed.
+	Slab* partial;
+	// One empty slab is kept around so a class bouncing between zero and one
+	// object doesn't hit the page allocator every time.
+	Slab* empty;
+	// Objects other harts freed into this class. They're pushed without a
+	// lock and picked up by the owning hart when it runs out of partial slabs,
+	// frees into the class itself, or goes idle.
+	FreeObject* remote_frees;
+	uint64_t num_slabs;
+	uint64_t objects_in_use;
+};
+
+// Each hart allocates from its own arena without taking a lock. Slabs
+// remember their arena, so objects freed on another hart find their way back.
+struct __attribute__((aligned (64))) SlabArena {
+	SlabClass classes[NUM_SLAB_CLASSES];
+};
+
+SlabArena slab_arenas[MAX_HART];
+
+// For callers that run before their hart has per-hart state.
+SlabArena shared_arena;
+thread::Lock shared_arena_mutex;
+
+uint64_t class_size(int index) {
+	return (uint64_t)SLAB_MIN_SIZE << index;
+}
+
+// Offset of the first object, past the header.
+uint64_t first_object_offset(int index) {
+	uint64_t align = class_size(index) < SLAB_MAX_ALIGN ? class_size(index) : SLAB_MAX_ALIGN;
+	return (sizeof(Slab) + align - 1) & ~(align - 1);
+}
+
+uint64_t slab_capacity(int index) {
+	return (SLAB_SIZE - first_object_offset(index)) / class_size(index);
+}
+
+int class_for_size(uint64_t size) {
+	int index = 0;
+	while (class_size(index) < size) {
+		index++;
+	}
+	return index;
+}
+
+SlabArena* get_arena() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (!hart_state) {
+		return nullptr;
+	}
+	return &slab_arenas[hart_state->hart_id];
+}
+
+void push_partial(SlabClass& slab_class, Slab* slab) {
+	slab->prev = nullptr;
+	slab->next = slab_class.partial;
+	if (slab->next) {
+		slab->next->prev = slab;
+	}
+	slab_class.partial = slab;
+}
+
+void remove_partial(SlabClass& slab_class, Slab* slab) {
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		slab_class.partial = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+}
+
+Slab* new_slab(SlabArena* arena, int index) {
+	PageBlock block;
+	if (allocate_page_block(SLAB_SIZE, block, PAGE_BLOCK_SLAB)) {
+		return nullptr;
+	}
+
+	uint64_t object_size = class_size(index);
+	uint64_t first = block.start + first_object_offset(index);
+
+	Slab* slab = (Slab*)block.start;
+	slab->arena = arena;
+	slab->index = index;
+	slab->in_use = 0;
+	slab->capacity = slab_capacity(index);
+	slab->free_list = nullptr;
+	for (uint64_t i = slab->capacity; i > 0; i--) {
+		FreeObject* object = (FreeObject*)(first + (i - 1) * object_size);
+		object->next = slab->free_list;
+		slab->free_list = object;
+	}
+	arena->classes[index].num_slabs++;
+
+	return slab;
+}
+
+// Only the arena's owner may call this, or anyone holding
+// shared_arena_mutex for the shared arena.
+void free_local(Slab* slab, FreeObject* object) {
+	SlabClass& slab_class = slab->arena->classes[slab->index];
+
+	if (!slab->free_list) {
+		push_partial(slab_class, slab);
+	}
+	object->next = slab->free_list;
+	slab->free_list = object;
+	slab->in_use--;
+	slab_class.objects_in_use--;
+
+	if (!slab->in_use) {
+		remove_partial(slab_class, slab);
+		if (slab_class.empty) {
+			slab_class.num_slabs--;
+			PageBlock block;
+			block.start = (uint64_t)slab;
+			block.size = SLAB_SIZE;
+			free_page_block(block);
+		} else {
+			slab_class.empty = slab;
+		}
+	}
+}
+
+Slab* get_slab(void* object) {
+	return (Slab*)((uint64_t)object & ~((uint64_t)SLAB_SIZE - 1));
+}
+
+void drain_remote_frees(SlabClass& slab_class) {
+	FreeObject* object = __atomic_exchange_n(&slab_class.remote_frees, nullptr, __ATOMIC_ACQUIRE);
+	while (object) {
+		FreeObject* next = object->next;
+		free_local(get_slab(object), object);
+		object = next;
+	}
+}
+
+void* alloc_local(SlabArena* arena, int index) {
+	SlabClass& slab_class = arena->classes[index];
+
+	if (!slab_class.partial && slab_class.remote_frees) {
+		drain_remote_frees(slab_class);
+	}
+
+	Slab* slab = slab_class.partial;
+	if (!slab) {
+		slab = slab_class.empty;
+		slab_class.empty = nullptr;
+		if (!slab) {
+			slab = new_slab(arena, index);
+		}
+		if (!slab) {
+			return nullptr;
+		}
+		push_partial(slab_class, slab);
+	}
+
+	FreeObject* object = slab->free_list;
+	slab->free_list = object->next;
+	slab->in_use++;
+	if (!slab->free_list) {
+		remove_partial(slab_class, slab);
+	}
+	slab_class.objects_in_use++;
+
+	return object;
+}
+
+} // namespace
+
+void* slab_alloc(uint64_t size) {
+	if (size > SLAB_MAX_SIZE) {
+		return nullptr;
+	}
+
+	SlabArena* arena = get_arena();
+	if (arena) {
+		return alloc_local(arena, class_for_size(size));
+	}
+
+	shared_arena_mutex.lock();
+	void* ret = alloc_local(&shared_arena, class_for_size(size));
+	shared_arena_mutex.unlock();
+
+	return ret;
+}
+
+void slab_free(void* to_free) {
+	Slab* slab = get_slab(to_free);
+	FreeObject* object = (FreeObject*)to_free;
+
+	if (slab->arena == &shared_arena) {
+		shared_arena_mutex.lock();
+		free_local(slab, object);
+		shared_arena_mutex.unlock();
+		return;
+	}
+
+	if (slab->arena == get_arena()) {
+		free_local(slab, object);
+		// Take back what other harts freed too, so a class we've stopped
+		// allocating from still gets its empty slabs returned.
+		SlabClass& slab_class = slab->arena->classes[slab->index];
+		if (__atomic_load_n(&slab_class.remote_frees, __ATOMIC_RELAXED)) {
+			drain_remote_frees(slab_class);
+		}
+		return;
+	}
+
+	// Hand the object back to the hart that owns the slab.
+	SlabClass& slab_class = slab->arena->classes[slab->index];
+	object->next = __atomic_load_n(&slab_class.remote_frees, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&slab_class.remote_frees,
+					    &object->next,
+					    object,
+					    true,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED));
+}
+
+void drain_slab_remote_frees() {
+	SlabArena* arena = get_arena();
+	if (!arena) {
+		return;
+	}
+	for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+		if (__atomic_load_n(&arena->classes[i].remote_frees, __ATOMIC_RELAXED)) {
+			drain_remote_frees(arena->classes[i]);
+		}
+	}
+}
+
+bool is_slab_address(const void* ptr) {
+	return is_slab_page((uint64_t)ptr);
+}
+
+// Adds up every arena without stopping their owners, so the numbers can be
+// slightly off while harts are allocating. Objects freed from another hart
+// count as in use until their owner picks them up.
+void get_slab_stats(int index, SlabStats& stats) {
+	stats.object_size = class_size(index);
+	stats.num_slabs = shared_arena.classes[index].num_slabs;
+	stats.objects_in_use = shared_arena.classes[index].objects_in_use;
+	for (int hart_id = 0; hart_id < MAX_HART; hart_id++) {
+		stats.num_slabs += slab_arenas[hart_id].classes[index].num_slabs;
+		stats.objects_in_use += slab_arenas[hart_id].classes[index].objects_in_use;
+	}
+	stats.capacity = slab_capacity(index) * stats.num_slabs;
+}
+
+void print_slab_stats() {
+	for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+		SlabStats stats;
+		get_slab_stats(i, stats);
+		if (stats.num_slabs) {
+			printk("Slab %d: %d of %d objects in use across %d slabs\n",
+			       stats.object_size,
+			       stats.objects_in_use,
+			       stats.capacity,
+			       stats.num_slabs);
+		}
+	}
+}
+
+} // namespace memory
@@ -0,0 +1,42 @@
+#ifndef MEMORY_SLAB_H
+#define MEMORY_SLAB_H
+
+#include <stdint.h>
+
+// Requests up to this size are served from power of two size classes,
+// starting at SLAB_MIN_SIZE.
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 2048
+#define NUM_SLAB_CLASSES 8
+
+namespace memory {
+
+struct SlabStats {
+	uint64_t object_size;
+	uint64_t num_slabs;
+	uint64_t objects_in_use;
+	uint64_t capacity;
+};
+
+// O(1) allocation from the size class that fits size, out of the calling
+// hart's own arena so no lock is taken. Returns nullptr if size is over
+// SLAB_MAX_SIZE or no pages are left for a new slab.
+void* slab_alloc(uint64_t size);
+
+// Objects owned by another hart's arena are pushed onto a lock-free list for
+// that hart to take back.
+void slab_free(void* to_free);
+
+// Takes back the objects other harts freed into the calling hart's arena.
+// Meant to be called from harts that have nothing better to do.
+void drain_slab_remote_frees();
+
+bool is_slab_address(const void* ptr);
+
+void get_slab_stats(int slab_class, SlabStats& stats);
+
+void print_slab_stats();
+
+} // namespace memory
+
+#endif
@@ -0,0 +1,194 @@
+#include "memory/stack.h"
+
+#include "config.h"
+#include "io/stdio.h"
+#include "memory/page.h"
+#include "memory/page_allocator.h"
+#include "memory/vmalloc.h"
+#include "thread/hart.h"
+#include "thread/lock.h"
+
+namespace memory {
+
+namespace {
+
+using io::printk;
+using io::print_stack_trace;
+
+#define STACK_GUARD_SIZE PAGE_SIZE
+#define NUM_STACK_SLOTS ((STACKS_END - STACKS_START) / MAX_STACK_SIZE)
+
+thread::Lock stack_mutex;
+
+// One bit per slot, set while it holds a live stack. Faults read it without
+// the lock.
+uint8_t slots_in_use[NUM_STACK_SLOTS / 8];
+
+// Zeroed pages each hart keeps for its stack faults, which can't call into
+// the page allocator in case the faulting code holds its lock. Only the hart
+// itself touches its reserve, from refills and from faults that may interrupt
+// them.
+struct StackReserve {
+	uint64_t pages[STACK_RESERVE_PAGES];
+	uint64_t num_pages;
+};
+
+StackReserve reserves[MAX_HART];
+
+bool slot_in_use(uint64_t slot) {
+	return __atomic_load_n(&slots_in_use[slot / 8], __ATOMIC_ACQUIRE) & (1 << (slot % 8));
+}
+
+// Slot of the live stack virtual_addr falls in, or -1.
+int64_t find_slot(uint64_t virtual_addr) {
+	if (virtual_addr < STACKS_START || virtual_addr >= STACKS_END) {
+		return -1;
+	}
+	uint64_t slot = (virtual_addr - STACKS_START) / MAX_STACK_SIZE;
+	return slot_in_use(slot) ? slot : -1;
+}
+
+// Only called from faults, which never interrupt each other.
+uint64_t take_reserve_page() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (!hart_state) {
+		return 0;
+	}
+
+	StackReserve* reserve = &reserves[hart_state->hart_id];
+	uint64_t num_pages = __atomic_load_n(&reserve->num_pages, __ATOMIC_ACQUIRE);
+	if (!num_pages) {
+		return 0;
+	}
+	uint64_t page = reserve->pages[num_pages - 1];
+	__atomic_store_n(&reserve->num_pages, num_pages - 1, __ATOMIC_RELEASE);
+	return page;
+}
+
+// Fills the next free slot, and only then counts it, so a fault between the
+// two just takes a different page. Returns false if the reserve is full.
+bool push_reserve_page(StackReserve* reserve, uint64_t page) {
+	uint64_t num_pages = __atomic_load_n(&reserve->num_pages, __ATOMIC_ACQUIRE);
+	do {
+		if (num_pages == STACK_RESERVE_PAGES) {
+			return false;
+		}
+		__atomic_store_n(&reserve->pages[num_pages], page, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&reserve->num_pages, &num_pages, num_pages + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return true;
+}
+
+} // namespace
+
+void* allocate_stack() {
+	PageTable* kernel_page_table = get_kernel_page_table();
+	if (!kernel_page_table) {
+		printk("allocate_stack: No kernel page table!\n");
+		print_stack_trace();
+		return nullptr;
+	}
+
+	// Lowest free slot first. Unmapping leaves the page tables behind, so
+	// packing stacks low keeps them reusing the same few tables.
+	stack_mutex.lock();
+	uint64_t slot = 0;
+	while (slot < NUM_STACK_SLOTS && slots_in_use[slot / 8] == 0xFF) {
+		slot += 8;
+	}
+	while (slot < NUM_STACK_SLOTS && slot_in_use(slot)) {
+		slot++;
+	}
+	if (slot == NUM_STACK_SLOTS) {
+		stack_mutex.unlock();
+		printk("allocate_stack: Out of stack slots!\n");
+		print_stack_trace();
+		return nullptr;
+	}
+	__atomic_or_fetch(&slots_in_use[slot / 8], 1 << (slot % 8), __ATOMIC_RELEASE);
+	stack_mutex.unlock();
+
+	// Stacks grow a page at a time, so fault-around would only back pages
+	// they may never reach. They're pinned since the idle loop compacts
+	// memory while running on one.
+	uint64_t bottom = STACKS_START + slot * MAX_STACK_SIZE;
+	uint64_t top = bottom + MAX_STACK_SIZE;
+	if (kernel_page_table->map_pages(bottom + STACK_GUARD_SIZE, top, PAGE_R | PAGE_W) ||
+	    kernel_page_table->set_fault_around(top - PAGE_SIZE, 1) ||
+	    kernel_page_table->set_pinned(top - PAGE_SIZE) ||
+	    kernel_page_table->populate_pages(top - PAGE_SIZE, top)) {
+		printk("allocate_stack: Out of memory!\n");
+		print_stack_trace();
+		free_stack((void*)top);
+		return nullptr;
+	}
+	refill_stack_reserve();
+
+	return (void*)top;
+}
+
+void free_stack(void* stack_top) {
+	uint64_t top = (uint64_t)stack_top;
+	int64_t slot = find_slot(top - 1);
+	if (slot < 0 || (top - STACKS_START) % MAX_STACK_SIZE) {
+		printk("free_stack: %x is not a stack!\n", top);
+		print_stack_trace();
+		return;
+	}
+
+	// Unmap before the slot can be handed out again. The region is managed,
+	// so its pages are freed with it.
+	if (get_kernel_page_table()->unmap_pages(top - MAX_STACK_SIZE + STACK_GUARD_SIZE, top)) {
+		printk("free_stack: Could not unmap %x!\n", top);
+		print_stack_trace();
+		return;
+	}
+
+	stack_mutex.lock();
+	__atomic_and_fetch(&slots_in_use[slot / 8], ~(1 << (slot % 8)), __ATOMIC_RELEASE);
+	stack_mutex.unlock();
+}
+
+int handle_stack_fault(uint64_t virtual_addr) {
+	if (find_slot(virtual_addr) < 0 || is_stack_guard(virtual_addr)) {
+		return -1;
+	}
+
+	// An empty reserve is fatal. Refilling from here could deadlock.
+	uint64_t page = take_reserve_page();
+	if (!page) {
+		printk("handle_stack_fault: Stack reserve empty at %x!\n", virtual_addr);
+		return -1;
+	}
+	int ret = get_kernel_page_table()->install_page(virtual_addr, page, PAGE_R | PAGE_W);
+	if (ret) {
+		// It's still zeroed, and there's room since we just took it.
+		push_reserve_page(&reserves[thread::get_hart_state()->hart_id], page);
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+bool is_stack_guard(uint64_t virtual_addr) {
+	return find_slot(virtual_addr) >= 0 &&
+	       (virtual_addr - STACKS_START) % MAX_STACK_SIZE < STACK_GUARD_SIZE;
+}
+
+void refill_stack_reserve() {
+	thread::HartState* hart_state = thread::get_hart_state();
+	if (!hart_state) {
+		return;
+	}
+
+	StackReserve* reserve = &reserves[hart_state->hart_id];
+	while (__atomic_load_n(&reserve->num_pages, __ATOMIC_ACQUIRE) < STACK_RESERVE_PAGES) {
+		PageBlock block;
+		if (allocate_page_block(PAGE_SIZE, block, PAGE_BLOCK_ZERO)) {
+			return;
+		}
+		if (!push_reserve_page(reserve, block.start)) {
+			free_page_block(block);
+			return;
+		}
+	}
+}
+
+} // namespace memory
@@ -0,0 +1,28 @@
+#ifndef MEMORY_STACK_H
+#define MEMORY_STACK_H
+
+#include <stdint.h>
+
+namespace memory {
+
+// Maps a new stack in the kernel page table and returns its top. Only the top
+// page is backed to begin with.
+void* allocate_stack();
+
+void free_stack(void* stack_top);
+
+// Backs the page of a stack a fault at virtual_addr ran into with one from the
+// hart's reserve. Takes no locks, so it's safe whatever the faulting code was
+// holding. Returns -1 if virtual_addr isn't in a live stack, hit its guard
+// page, or the reserve has run dry.
+int handle_stack_fault(uint64_t virtual_addr);
+
+bool is_stack_guard(uint64_t virtual_addr);
+
+// Tops up the calling hart's reserve for stack faults. Must be called with no
+// locks held, the executor does after every task and when idle.
+void refill_stack_reserve();
+
+} // namespace memory
+
+#endif
@@ -0,0 +1,233 @@
+#include "memory/vmalloc.h"
+
+#include "config.h"
+#include "io/stdio.h"
+#include "memory/heap.h"
+#include "memory/page_allocator.h"
+#include "thread/lock.h"
+
+namespace memory {
+
+namespace {
+
+using io::printk;
+using io::print_stack_trace;
+
+// Unmapped page left after every area so overruns fault instead of running
+// into the next buffer.
+#define VMALLOC_GUARD_SIZE PAGE_SIZE
+
+struct VmallocArea {
+	VmallocArea* next;
+	uint64_t start;
+	uint64_t size;
+	// Set while vfree unmaps the area. It stays in the list until then so
+	// the range can't be handed out again under it.
+	bool freeing;
+};
+
+PageTable* kernel_page_table = nullptr;
+
+thread::Lock vmalloc_mutex;
+
+// Live areas sorted by start address.
+VmallocArea* areas = nullptr;
+
+// Virtual ranges are handed out next fit, so a freed range isn't reused until
+// the cursor wraps around the whole vmalloc space. Unmapping already fences
+// the other harts, this just keeps reuse (and the chance of a stray pointer
+// hitting a new buffer) rare.
+uint64_t vmalloc_cursor = VMALLOC_START;
+
+// Finds a gap of at least size bytes (guard page included) at or after start,
+// and returns the area it should be linked after in prev. Caller must hold
+// vmalloc_mutex.
+bool find_gap(uint64_t start, uint64_t size, uint64_t& virtual_addr, VmallocArea*& prev) {
+	prev = nullptr;
+	VmallocArea* curr = areas;
+	while (curr && curr->start + curr->size + VMALLOC_GUARD_SIZE <= start) {
+		prev = curr;
+		curr = curr->next;
+	}
+
+	virtual_addr = start;
+	while (true) {
+		if (prev && prev->start + prev->size + VMALLOC_GUARD_SIZE > virtual_addr) {
+			virtual_addr = prev->start + prev->size + VMALLOC_GUARD_SIZE;
+		}
+		uint64_t gap_end = curr ? curr->start : VMALLOC_END;
+		if (virtual_addr + size + VMALLOC_GUARD_SIZE <= gap_end) {
+			return true;
+		}
+		if (!curr) {
+			return false;
+		}
+		prev = curr;
+		curr = curr->next;
+	}
+}
+
+} // namespace
+
+int initialize_vmalloc() {
+	initialize_paging();
+	kernel_page_table = new PageTable();
+
+	// Identity map everything up to the end of RAM, which takes in the MMIO
+	// devices below it, using gigapages where possible.
+	uint64_t identity_end = (get_memory_end() + GIGAPAGE_SIZE - 1) & ~((uint64_t)GIGAPAGE_SIZE - 1);
+	if (kernel_page_table->map_pages(0, identity_end, 0, identity_end, PAGE_R | PAGE_W | PAGE_X)) {
+		printk("Cannot build kernel page table!\n");
+		print_stack_trace();
+		return -1;
+	}
+
+	// The direct map is global, so its TLB entries are shared by every
+	// address space. Other tables copy its leaves one by one when they're
+	// built, so it must be complete before the first of them.
+	uint64_t direct_start = get_memory_start() & ~((uint64_t)GIGAPAGE_SIZE - 1);
+	if (identity_end - direct_start > DIRECT_MAP_END - DIRECT_MAP_START ||
+	    kernel_page_table->map_pages(DIRECT_MAP_START + direct_start,
+					 DIRECT_MAP_START + identity_end,
+					 direct_start,
+					 identity_end,
+					 PAGE_R | PAGE_W | PAGE_G)) {
+		printk("Cannot build direct map!\n");
+		print_stack_trace();
+		return -1;
+	}
+
+	kernel_page_table->use_page_table();
+	enable_direct_map();
+
+	return 0;
+}
+
+void use_kernel_page_table() {
+	if (kernel_page_table) {
+		kernel_page_table->use_page_table();
+	}
+}
+
+PageTable* get_kernel_page_table() {
+	return kernel_page_table;
+}
+
+void* vmalloc(uint64_t size) {
+	if (!kernel_page_table) {
+		printk("vmalloc: No kernel page table!\n");
+		print_stack_trace();
+		return nullptr;
+	}
+
+	size = (size + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+	if (!size) {
+		return nullptr;
+	}
+
+	VmallocArea* area = (VmallocArea*)kmalloc(sizeof(VmallocArea));
+	if (!area) {
+		return nullptr;
+	}
+
+	// Align big areas to a megapage so they can be backed with megapages.
+	uint64_t align = size >= MEGAPAGE_SIZE ? MEGAPAGE_SIZE : PAGE_SIZE;
+
+	vmalloc_mutex.lock();
+
+	uint64_t virtual_addr;
+	VmallocArea* prev;
+	uint64_t start = (vmalloc_cursor + align - 1) & ~(align - 1);
+	bool found = find_gap(start, size + align - PAGE_SIZE, virtual_addr, prev);
+	if (!found) {
+		found = find_gap(VMALLOC_START, size + align - PAGE_SIZE, virtual_addr, prev);
+	}
+	if (!found) {
+		vmalloc_mutex.unlock();
+		kfree(area);
+		printk("vmalloc: Out of virtual address space!\n");
+		print_stack_trace();
+		return nullptr;
+	}
+
+	area->start = (virtual_addr + align - 1) & ~(align - 1);
+	area->size = size;
+	area->freeing = false;
+	area->next = prev ? prev->next : areas;
+	if (prev) {
+		prev->next = area;
+	} else {
+		areas = area;
+	}
+	vmalloc_cursor = area->start + size + VMALLOC_GUARD_SIZE;
+
+	vmalloc_mutex.unlock();
+
+	// The area is reserved, so the mapping can be built without holding
+	// vmalloc_mutex.
+	if (kernel_page_table->map_pages(area->start, area->start + size, PAGE_R | PAGE_W) ||
+	    kernel_page_table->populate_pages(area->start, area->start + size)) {
+		printk("vmalloc: Out of memory!\n");
+		print_stack_trace();
+		vfree((void*)area->start);
+		return nullptr;
+	}
+
+	return (void*)area->start;
+}
+
+void vfree(void* to_free) {
+	uint64_t virtual_addr = (uint64_t)to_free;
+
+	vmalloc_mutex.lock();
+
+	VmallocArea* curr = areas;
+	while (curr && curr->start != virtual_addr) {
+		curr = curr->next;
+	}
+
+	if (!curr || curr->freeing) {
+		vmalloc_mutex.unlock();
+		printk("vfree: %x was not allocated by vmalloc!\n", virtual_addr);
+		print_stack_trace();
+		return;
+	}
+	curr->freeing = true;
+
+	vmalloc_mutex.unlock();
+
+	// Unmapping fences every hart, so it's done without the lock. Managed
+	// regions free their backing pages as they're unmapped.
+	if (kernel_page_table->unmap_pages(curr->start, curr->start + curr->size)) {
+		vmalloc_mutex.lock();
+		curr->freeing = false;
+		vmalloc_mutex.unlock();
+		printk("vfree: Could not unmap %x!\n", virtual_addr);
+		print_stack_trace();
+		return;
+	}
+
+	// The list may have changed meanwhile, so find the area's predecessor
+	// again.
+	vmalloc_mutex.lock();
+	VmallocArea* prev = nullptr;
+	VmallocArea* next = areas;
+	while (next != curr) {
+		prev = next;
+		next = next->next;
+	}
+	if (prev) {
+		prev->next = curr->next;
+	} else {
+		areas = curr->next;
+	}
+	vmalloc_mutex.unlock();
+
+	kfree(curr);
+}
+
+bool is_vmalloc_address(const void* ptr) {
+	return (uint64_t)ptr >= VMALLOC_START && (uint64_t)ptr < VMALLOC_END;
+}
+
+} // namespace memory
@@ -0,0 +1,32 @@
+#ifndef MEMORY_VMALLOC_H
+#define MEMORY_VMALLOC_H
+
+#include <stdint.h>
+
+#include "memory/page.h"
+
+namespace memory {
+
+// Builds the kernel page table, an identity map of physical memory and the
+// devices below it, the direct map and the vmalloc range, and switches the
+// calling hart to it.
+int initialize_vmalloc();
+
+// Switches a secondary hart to the kernel page table. Does nothing before
+// initialize_vmalloc.
+void use_kernel_page_table();
+
+PageTable* get_kernel_page_table();
+
+// Allocates a virtually contiguous buffer backed by whatever pages are free,
+// so it doesn't need a physically contiguous run. Megapages are used where
+// they fit. The buffer is zeroed.
+void* vmalloc(uint64_t size);
+
+void vfree(void* to_free);
+
+bool is_vmalloc_address(const void* ptr);
+
+} // namespace memory
+
+#endif
@@ -2,26 +2,117 @@
 
 #include "thread/hart.h"
 
+#include "cpu/scratch.h"
+#include "io/stdio.h"
+
 namespace thread {
 
 namespace {
 
+HartState hart_states[MAX_HART];
+
+uint64_t hart_ids[MAX_HART];
+uint64_t num_harts = 0;
+
+// NUMA node of each hart, indexed by hart id.
+int hart_nodes[MAX_HART];
+
+// What a started hart needs before it can run C. Stacks are mapped in the
+// kernel page table, so the hart has to load it before touching its stack.
+struct HartBootRecord {
+	uint64_t satp;
+	uint64_t stack_top;
+	uint64_t entry_func;
+	uint64_t arg;
+};
+
+HartBootRecord boot_records[MAX_HART];
+
 extern "C" void* hart_entry;
 
+// SBI hands us the boot record in a1.
 asm volatile(
 	"hart_entry:			\n"
-	"add sp, zero, a1		\n"
-	"ld s1, -0x40(sp)		\n"
-	"ld a1, -0x80(sp)		\n"
+	"ld t0, 0(a1)			\n"
+	"csrw satp, t0			\n"
+	"sfence.vma zero, zero		\n"
+	"ld sp, 8(a1)			\n"
+	"ld s1, 16(a1)			\n"
+	"ld a1, 24(a1)			\n"
 	"la s0, 0			\n"
-	"jalr s1			\n");
+	"jalr s1			\n"
+	"1:				\n"
+	"wfi				\n"
+	"j 1b				\n");
 
 } // namespace
 
+void initialize_harts(const lib::Fdt& fdt, uint64_t boot_hart_id) {
+	num_harts = 0;
+
+	lib::FdtNode cpu;
+	bool found = fdt.find_node("/cpus", cpu) && fdt.get_first_child(cpu, cpu);
+	while (found) {
+		lib::FdtProperty device_type;
+		uint64_t hart_id;
+		uint64_t discard;
+		if (fdt.get_property(cpu, "device_type", device_type) &&
+		    device_type.equals("cpu") &&
+		    fdt.is_enabled(cpu) &&
+		    fdt.get_reg(cpu, 0, hart_id, discard)) {
+			if (hart_id >= MAX_HART) {
+				io::printk("Ignoring hart %d, MAX_HART is %d\n", hart_id, MAX_HART);
+			} else {
+				lib::FdtProperty numa_node_id;
+				hart_nodes[hart_id] = 0;
+				if (fdt.get_property(cpu, "numa-node-id", numa_node_id) &&
+				    numa_node_id.get_cell(0) < MAX_NUMA_NODES) {
+					hart_nodes[hart_id] = numa_node_id.get_cell(0);
+				}
+				hart_ids[num_harts] = hart_id;
+				num_harts++;
+			}
+		}
+		found = fdt.get_next_sibling(cpu, cpu);
+	}
+
+	if (!num_harts) {
+		hart_ids[0] = boot_hart_id;
+		hart_nodes[boot_hart_id] = 0;
+		num_harts = 1;
+	}
+}
+
+uint64_t get_num_harts() {
+	return num_harts;
+}
+
+uint64_t get_hart_id(uint64_t index) {
+	return hart_ids[index];
+}
+
+int get_hart_node(uint64_t hart_id) {
+	return hart_nodes[hart_id];
+}
+
+void init_hart_state(uint64_t hart_id) {
+	hart_states[hart_id].hart_id = hart_id;
+	cpu::set_scratch((uint64_t)&hart_states[hart_id]);
+}
+
+HartState* get_hart_state() {
+	return (HartState*)cpu::get_scratch();
+}
+
 int64_t start_hart(void (*entry_func)(uint64_t, uint64_t), int hart_id, uint64_t arg, void* stack_top) {
 	int64_t ret;
-	*(uint64_t*)((uint8_t*)stack_top-128) = arg; 
-	*(uint64_t*)((uint8_t*)stack_top-64) = (uint64_t)entry_func; 
+	HartBootRecord* record = &boot_records[hart_id];
+	asm volatile(
+		"csrr %0, satp		\n"
+		: "=r"(record->satp));
+	record->stack_top = (uint64_t)stack_top;
+	record->entry_func = (uint64_t)entry_func;
+	record->arg = arg;
 	asm volatile(
 		"add a0, zero, %1	\n" // Load hart id
 		"add a1, zero, %2	\n" // Load start addr
@@ -33,8 +124,69 @@ int64_t start_hart(void (*entry_func)(uint64_t, uint64_t), int hart_id, uint64_t
 		: "=r"(ret)
 		: "r"(hart_id),
 		  "r"(&hart_entry),
-		  "r"(stack_top)
-		: "a0", "a1", "a2", "a6", "a7");
+		  "r"(record)
+		: "a0", "a1", "a2", "a6", "a7", "memory");
+	return ret;
+}
+
+void run_on_stack(void (*entry_func)(uint64_t, uint64_t), uint64_t hart_id, uint64_t arg, void* stack_top) {
+	HartBootRecord* record = &boot_records[hart_id];
+	asm volatile(
+		"csrr %0, satp		\n"
+		: "=r"(record->satp));
+	record->stack_top = (uint64_t)stack_top;
+	record->entry_func = (uint64_t)entry_func;
+	record->arg = arg;
+	// Enter the same way a started hart does.
+	asm volatile(
+		"add a0, zero, %0	\n" // Load hart id
+		"add a1, zero, %1	\n" // Load boot record
+		"la t0, hart_entry	\n"
+		"jr t0			\n"
+		:
+		: "r"(hart_id),
+		  "r"(record)
+		: "a0", "a1", "t0", "memory");
+	__builtin_unreachable();
+}
+
+int64_t remote_sfence_vma(uint64_t hart_mask, uint64_t start, uint64_t size) {
+	int64_t ret;
+	asm volatile(
+		"add a0, zero, %1	\n" // Load hart mask
+		"add a1, zero, zero	\n" // Mask starts at hart 0
+		"add a2, zero, %2	\n" // Load start addr
+		"add a3, zero, %3	\n" // Load size
+		"li a7, 0x52464E43	\n" // EID: RFENCE
+		"li a6, 0x01		\n" // FID: 1
+		"ecall			\n"
+		"add %0, zero, a0	\n"
+		: "=r"(ret)
+		: "r"(hart_mask),
+		  "r"(start),
+		  "r"(size)
+		: "a0", "a1", "a2", "a3", "a6", "a7", "memory");
+	return ret;
+}
+
+int64_t remote_sfence_vma_asid(uint64_t hart_mask, uint64_t start, uint64_t size, uint64_t asid) {
+	int64_t ret;
+	asm volatile(
+		"add a0, zero, %1	\n" // Load hart mask
+		"add a1, zero, zero	\n" // Mask starts at hart 0
+		"add a2, zero, %2	\n" // Load start addr
+		"add a3, zero, %3	\n" // Load size
+		"add a4, zero, %4	\n" // Load ASID
+		"li a7, 0x52464E43	\n" // EID: RFENCE
+		"li a6, 0x02		\n" // FID: 2
+		"ecall			\n"
+		"add %0, zero, a0	\n"
+		: "=r"(ret)
+		: "r"(hart_mask),
+		  "r"(start),
+		  "r"(size),
+		  "r"(asid)
+		: "a0", "a1", "a2", "a3", "a4", "a6", "a7", "memory");
 	return ret;
 }
 
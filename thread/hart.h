@@ -4,13 +4,58 @@
 #include <stdint.h>
 
 #include "config.h"
+#include "lib/fdt.h"
+
+// Size that asks the remote fences to flush the whole address space.
+#define SFENCE_ALL ~0ULL
 
 namespace thread { 
 
+// Per-hart kernel state. While a hart runs kernel code its sscratch register
+// points at its own entry.
+struct HartState {
+	uint64_t hart_id;
+	// Traps switch to this stack, so faults on a task stack have somewhere
+	// to run. trap_scratch holds the registers the trap vector needs to get
+	// there. The vector hardcodes both offsets.
+	uint64_t trap_stack_top;
+	uint64_t trap_scratch[2];
+};
+static_assert(__builtin_offsetof(HartState, trap_stack_top) == 8, "trap_entry expects trap_stack_top at 8");
+static_assert(__builtin_offsetof(HartState, trap_scratch) == 16, "trap_entry expects trap_scratch at 16");
+
+// Records the enabled harts listed under /cpus. Falls back to just the boot
+// hart if the device tree doesn't list any.
+void initialize_harts(const lib::Fdt& fdt, uint64_t boot_hart_id);
+
+uint64_t get_num_harts();
+
+// Hart id of the index'th hart found by initialize_harts.
+uint64_t get_hart_id(uint64_t index);
+
+// NUMA node the hart's cpu node is tagged with, 0 if it isn't.
+int get_hart_node(uint64_t hart_id);
+
+// Must be called on each hart before it touches any per-hart state.
+void init_hart_state(uint64_t hart_id);
+
+// Returns nullptr if the current hart hasn't been initialized yet.
+HartState* get_hart_state();
+
 int64_t start_hart(void (*entry_func)(uint64_t, uint64_t), int hart_id, uint64_t arg, void* stack_top);
 
+// Moves the calling hart onto stack_top and runs entry_func there, just like
+// start_hart would on another hart. Never returns.
+void run_on_stack(void (*entry_func)(uint64_t, uint64_t), uint64_t hart_id, uint64_t arg, void* stack_top);
+
 int64_t stop_hart();
 
+// Runs sfence.vma over [start, start + size) on every hart in hart_mask (bit n
+// is hart n) and returns once they all have. The _asid variant leaves other
+// address spaces and global mappings alone.
+int64_t remote_sfence_vma(uint64_t hart_mask, uint64_t start, uint64_t size);
+int64_t remote_sfence_vma_asid(uint64_t hart_mask, uint64_t start, uint64_t size, uint64_t asid);
+
 } // namespace thread
 
 #endif
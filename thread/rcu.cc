@@ -0,0 +1,59 @@
+#include "thread/rcu.h"
+
+#include "config.h"
+#include "thread/hart.h"
+
+namespace thread {
+
+namespace {
+
+// Each hart's slot holds the epoch its current critical section started in,
+// or zero outside of one. Slots get their own cache line.
+struct ReaderSlot {
+	uint64_t epoch;
+} __attribute__((aligned (64)));
+
+uint64_t rcu_epoch = 1;
+ReaderSlot reader_slots[MAX_HART];
+
+} // namespace
+
+// Harts without per-hart state yet are still booting, before anything else
+// can be running.
+void rcu_read_lock() {
+	HartState* hart_state = get_hart_state();
+	if (!hart_state) {
+		return;
+	}
+	__atomic_store_n(&reader_slots[hart_state->hart_id].epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	// Publish the slot before reading anything the section protects.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock() {
+	HartState* hart_state = get_hart_state();
+	if (!hart_state) {
+		return;
+	}
+	__atomic_store_n(&reader_slots[hart_state->hart_id].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void synchronize_rcu() {
+	HartState* hart_state = get_hart_state();
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+	for (uint64_t hart_id = 0; hart_id < MAX_HART; hart_id++) {
+		if (hart_state && hart_state->hart_id == hart_id) {
+			continue;
+		}
+		// Sections that picked up the new epoch started after we did.
+		while (true) {
+			uint64_t reader_epoch = __atomic_load_n(&reader_slots[hart_id].epoch, __ATOMIC_ACQUIRE);
+			if (!reader_epoch || reader_epoch >= epoch) {
+				break;
+			}
+		}
+	}
+}
+
+} // namespace thread
@@ -0,0 +1,20 @@
+#ifndef THREAD_RCU_H
+#define THREAD_RCU_H
+
+#include <stdint.h>
+
+namespace thread {
+
+// Epoch based read-side critical sections. Readers only touch their own
+// hart's slot, so they never contend with each other. Sections can't nest,
+// and mustn't wait on anything held by a caller of synchronize_rcu.
+void rcu_read_lock();
+void rcu_read_unlock();
+
+// Returns once every read-side critical section that was running when it was
+// called has ended. Sections that start afterwards aren't waited for.
+void synchronize_rcu();
+
+} // namespace thread
+
+#endif